@@ -0,0 +1,314 @@
+/* See LICENSE for license details. */
+/*
+ * Render-only benchmark: fills the terminal with synthetic workloads and
+ * times draw() and the XSync() after it per frame. Filling the terminal is
+ * not timed. Run it against any display, e.g. Xvfb.
+ *
+ * With -p, the output of a recording made with st -R is parsed instead,
+ * without drawing, to compare parsers on real streams.
+ */
+#include <stdarg.h>
+
+#define main stmain /* st-bench brings its own */
+#include "x.c"
+#undef main
+
+typedef struct {
+	char *name;
+	void (*fill)(int);  /* prepare frame n */
+} Workload;
+
+static void filltruecolor(int);
+static void fillcjk(int);
+static void fillattrs(int);
+static void fillscroll(int);
+
+static Workload workloads[] = {
+	{ "truecolor", filltruecolor },
+	{ "cjk",       fillcjk },
+	{ "attrs",     fillattrs },
+	{ "scroll",    fillscroll },
+};
+
+static void
+bwrite(const char *fmt, ...)
+{
+	char buf[128];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	twrite(buf, MIN(n, sizeof(buf) - 1), 0);
+}
+
+/* every cell in its own fore- and background color */
+void
+filltruecolor(int n)
+{
+	int x, y;
+
+	bwrite("\033[H");
+	for (y = 0; y < rows; y++) {
+		for (x = 0; x < cols; x++) {
+			bwrite("\033[38;2;%d;%d;%dm\033[48;2;%d;%d;%dm%c",
+					(x * 4 + n) & 255, (y * 8) & 255,
+					(x + y + n) & 255, (255 - x * 4) & 255,
+					(n * 3) & 255, (y * 4) & 255,
+					'!' + (x + y + n) % 94);
+		}
+	}
+	bwrite("\033[m");
+}
+
+/* wide characters, two cells each */
+void
+fillcjk(int n)
+{
+	Rune u;
+	char buf[4];
+	int x, y;
+
+	bwrite("\033[H");
+	for (y = 0; y < rows; y++) {
+		for (x = 0; x + 1 < cols; x += 2) {
+			u = 0x4E00 + (y * cols + x + n * 7) % 0x5000;
+			twrite(buf, utf8encode(u, buf), 0);
+		}
+		if (y + 1 < rows)
+			bwrite("\r\n");
+	}
+}
+
+/* short runs of every attribute combination */
+void
+fillattrs(int n)
+{
+	static const int sgr[] = { 1, 2, 3, 4, 5, 7, 9 };
+	int i, x, y, k;
+
+	bwrite("\033[H");
+	for (y = 0; y < rows; y++) {
+		for (x = 0; x < cols; x++) {
+			if ((x + n) % 4 == 0) {
+				k = (x / 4 + y + n) % (1 << LEN(sgr));
+				bwrite("\033[0;%dm", 30 + k % 8);
+				for (i = 0; i < LEN(sgr); i++) {
+					if (k & 1 << i)
+						bwrite("\033[%dm", sgr[i]);
+				}
+			}
+			bwrite("%c", 'a' + (x + y) % 26);
+		}
+	}
+	bwrite("\033[m");
+}
+
+/* a new line in a scroll region without the first and last row */
+void
+fillscroll(int n)
+{
+	int x;
+
+	if (n == 0) {
+		bwrite("\033[2J\033[2;%dr", rows - 1);
+		bwrite("\033[%dH", rows - 1);
+	}
+	bwrite("\n\r\033[3%dm", n % 8);
+	for (x = 0; x < cols; x++)
+		bwrite("%c", '0' + (x + n) % 10);
+	bwrite("\033[m");
+}
+
+static int
+cmpdouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+bench(Workload *w, int frames)
+{
+	struct timespec t0, t1, t2;
+	double *dt, *st, sdraw = 0, ssync = 0;
+	int i;
+
+	dt = xmalloc(frames * sizeof(*dt));
+	st = xmalloc(frames * sizeof(*st));
+
+	bwrite("\033c");
+	for (i = 0; i < frames; i++) {
+		w->fill(i);
+		if (w->fill != fillscroll)
+			tfulldirt();
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		draw();
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		XSync(xw.dpy, False);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		sdraw += dt[i] = TIMEDIFF(t1, t0);
+		ssync += st[i] = TIMEDIFF(t2, t1);
+	}
+	qsort(dt, frames, sizeof(*dt), cmpdouble);
+	qsort(st, frames, sizeof(*st), cmpdouble);
+
+	printf("workload=%s cols=%u rows=%u frames=%d "
+	       "draw_ms_mean=%.3f draw_ms_p50=%.3f draw_ms_max=%.3f "
+	       "sync_ms_mean=%.3f sync_ms_max=%.3f fps=%.1f\n",
+	       w->name, cols, rows, frames,
+	       sdraw / frames, dt[(frames - 1) / 2], dt[frames - 1],
+	       ssync / frames, st[frames - 1], 1E3 * frames / (sdraw + ssync));
+	fflush(stdout);
+
+	free(dt);
+	free(st);
+}
+
+/* the tty output of a recording, without its timing */
+static char *
+loadrecording(char *file, size_t *len)
+{
+	FILE *f;
+	char *data = NULL;
+	uint64_t us;
+	uint32_t n;
+	size_t siz = 0;
+	int col, row;
+
+	f = recordopen(file, &col, &row);
+
+	*len = 0;
+	while (fread(&us, sizeof(us), 1, f) == 1 &&
+	       fread(&n, sizeof(n), 1, f) == 1) {
+		/* resizes are not parsed */
+		if (n == RECRESIZE) {
+			if (fseek(f, 2 * sizeof(uint32_t), SEEK_CUR) < 0)
+				die("truncated recording\n");
+			continue;
+		}
+		if (*len + n > siz)
+			data = xrealloc(data, siz = 2 * (*len + n));
+		if (fread(data + *len, 1, n, f) != n)
+			die("truncated recording\n");
+		*len += n;
+	}
+	fclose(f);
+
+	return data;
+}
+
+static void
+benchparse(char *file, int passes)
+{
+	struct timespec t0, t1;
+	double *pt, sum = 0;
+	size_t len;
+	char *data;
+	int i;
+
+	data = loadrecording(file, &len);
+	pt = xmalloc(passes * sizeof(*pt));
+
+	/* replies to queries in the recording go nowhere */
+	if (!freopen("/dev/null", "r+", stdin))
+		die("freopen /dev/null failed: %s\n", strerror(errno));
+
+	for (i = 0; i < passes; i++) {
+		twrite("\033c", 2, 0);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		twrite(data, len, 0);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		sum += pt[i] = TIMEDIFF(t1, t0);
+	}
+	qsort(pt, passes, sizeof(*pt), cmpdouble);
+
+	printf("workload=parse file=%s bytes=%zu passes=%d "
+	       "parse_ms_mean=%.3f parse_ms_p50=%.3f parse_ms_max=%.3f "
+	       "mb_per_s=%.1f\n",
+	       file, len, passes, sum / passes, pt[(passes - 1) / 2],
+	       pt[passes - 1], len * passes / (sum * 1E3));
+	fflush(stdout);
+
+	free(pt);
+	free(data);
+}
+
+static void
+benchusage(void)
+{
+	die("usage: %s [-f font] [-g geometry] [-n frames] [-p recording] "
+	    "[workload ...]\n", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	XEvent ev;
+	char *recording = NULL;
+	int frames = 200, i, j;
+
+	xw.l = xw.t = 0;
+	xw.isfixed = False;
+	xsetcursor(cursorshape);
+
+	ARGBEGIN {
+	case 'f':
+		opt_font = EARGF(benchusage());
+		break;
+	case 'g':
+		xw.gm = XParseGeometry(EARGF(benchusage()),
+				&xw.l, &xw.t, &cols, &rows);
+		break;
+	case 'n':
+		frames = atoi(EARGF(benchusage()));
+		break;
+	case 'p':
+		recording = EARGF(benchusage());
+		break;
+	default:
+		benchusage();
+	} ARGEND;
+
+	if (frames < 1)
+		benchusage();
+	opt_title = "st-bench";
+
+	setlocale(LC_CTYPE, "");
+	XSetLocaleModifiers("");
+	if (!(xw.dpy = XOpenDisplay(NULL)))
+		die("Can't open display\n");
+
+	config_init();
+	cols = MAX(cols, 1);
+	rows = MAX(rows, 1);
+	defaultbg = MAX(LEN(colorname), 256);
+	tnew(cols, rows);
+	xinit(cols, rows);
+	selinit();
+
+	do {
+		XNextEvent(xw.dpy, &ev);
+	} while (ev.type != MapNotify);
+	win.mode |= MODE_VISIBLE;
+
+	if (recording) {
+		benchparse(recording, frames);
+		return 0;
+	}
+
+	for (i = 0; i < LEN(workloads); i++) {
+		for (j = 0; j < argc; j++) {
+			if (!strcmp(argv[j], workloads[i].name))
+				break;
+		}
+		if (argc == 0 || j < argc)
+			bench(&workloads[i], frames);
+	}
+
+	return 0;
+}
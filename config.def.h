@@ -39,6 +39,14 @@ wchar_t *worddelimiters = L" ";
 /* selection timeouts (in milliseconds) */
 static unsigned int doubleclicktimeout = 300;
 static unsigned int tripleclicktimeout = 600;
+/* an INCR transfer is dropped if its requestor takes no chunk for this long */
+static unsigned int incrtimeout = 5000;
+
+/*
+ * maximum bytes of a selection stored in the property of a requestor at
+ * once; larger selections are transferred incrementally (INCR)
+ */
+static unsigned int selchunksize = 256 * 1024;
 
 /* alt screens */
 int allowaltscreen = 1;
@@ -56,6 +64,28 @@ int allowwindowops = 0;
 static double minlatency = 8;
 static double maxlatency = 33;
 
+/*
+ * frame pacing: if framesync is set, draws are aligned to the refresh period
+ * of the monitor instead of the idle detection above, and everything that
+ * arrives in between goes into the same frame. The period is read from RandR
+ * (see config.mk); refreshperiod (in ms) is used if that is not compiled in
+ * or reports nothing usable, as under Xvfb.
+ */
+static int framesync = 0;
+static float refreshperiod = 1000.0 / 60;
+
+/*
+ * maximum number of reads from the tty in one go while the window is not
+ * visible, when nothing is drawn and st only parses.
+ */
+static unsigned int hiddenreads = 64;
+
+/*
+ * SIGUSR1 and dumpstats() append statistics, like the latency from key
+ * press to frame, to this file, or write them to stderr if it is NULL.
+ */
+static char *statsfile = NULL;
+
 /*
  * blinking timeout (set to 0 to disable blinking) for the terminal blinking
  * attribute.
@@ -218,6 +248,8 @@ ResourcePref resources[] = {
 		{ "minlatency",   INTEGER, &minlatency },
 		{ "maxlatency",   INTEGER, &maxlatency },
 		{ "blinktimeout", INTEGER, &blinktimeout },
+		{ "framesync",    INTEGER, &framesync },
+		{ "refreshperiod",FLOAT,   &refreshperiod },
 		{ "bellvolume",   INTEGER, &bellvolume },
 		{ "tabspaces",    INTEGER, &tabspaces },
 		{ "borderpx",     INTEGER, &borderpx },
@@ -256,6 +288,10 @@ static Shortcut shortcuts[] = {
 	{ TERMMOD,              XK_Y,           selpaste,       {.i =  0} },
 	{ ShiftMask,            XK_Insert,      selpaste,       {.i =  0} },
 	{ TERMMOD,              XK_Num_Lock,    numlock,        {.i =  0} },
+	{ TERMMOD,              XK_S,           dumpstats,      {.i =  0} },
+	{ TERMMOD,              XK_T,           newtab,         {.i =  0} },
+	{ TERMMOD,              XK_Next,        nexttab,        {.i = +1} },
+	{ TERMMOD,              XK_Prior,       nexttab,        {.i = -1} },
 	{ MODKEY,               XK_c,           normalMode,     {.i =  0} },
 };
 
@@ -5,7 +5,7 @@
 #include "utils.h"
 
 extern Glyph const styleSearch, style[];
-extern char const wDelS[], wDelL[], *nmKeys[];
+extern char const *nmKeys[];
 extern unsigned int bg[], fg, currentBg, highlightBg, highlightFg, amountNmKeys;
 
 typedef struct { int p[3]; } Pos;
@@ -103,6 +103,43 @@ static ExitState expandExpression(char l) { //    ({ =>)       l  ?  {  \n | l |
 	return pressKeys(mot, 11);
 }
 
+/// Word class of a letter: WC_SPACE, WC_WORD or WC_PUNCT (WC_WORD for WEB).
+static inline int wordClass(Rune u, int low) {
+	int const n = wordclass(u) & ~WC_DELIM;
+	return (low && n == WC_PUNCT) ? WC_WORD : n;
+}
+/// Letter at column x of line y relative to the top of the view; y may leave the screen.
+static inline Rune wordChar(int x, int y) {
+	return (IS_SET(MODE_ALTSCREEN) ? term.line[y] : buf[rangeY(histOff + y)])[x].u;
+}
+/// Advance position (x, y) by d letters, wrapping around at the line ends.
+static inline void wordStep(int *x, int *y, int d) {
+	if ((*x += d) >= term.col) *x = 0, ++*y; else if (*x < 0) *x = term.col-1, --*y;
+}
+/// Perform the word motions wWeEbB on the rows directly and move the cursor once in the end.
+static void wordMotion(char const cs) {
+	int const low=cs<=90, off=tolower(cs)!='w', sgn=(tolower(cs)=='b')?-1:1, alt=IS_SET(MODE_ALTSCREEN),
+	          top=alt?0:-rangeY(-term.row-(insertOff-histOff)), bot=term.row-1+(alt?0:rangeY(insertOff-histOff)),
+	          maxIt=rows()*term.col;
+	int x = term.c.x, y = term.c.y;
+	for (int it=0, on=0; state.m.c > 0 && it < maxIt; ++it) {
+		// If an offset is to be performed in beginning or not in beginning, move in history.
+		if ((off || it) && (wordStep(&x, &y, sgn), y > bot || y < top)) {
+			x = sgn>0 ? term.col-1 : 0, y = sgn>0 ? bot : top;
+			break;
+		}
+		// Determine if the category of the current letter changed since last iteration.
+		int n = wordClass(wordChar(x, y), low), found = (on|=n)^n && ((off ?on^n :n)!=1);
+		// If a reverse offset is to be performed and this is the last letter:
+		if (found && off) wordStep(&x, &y, -sgn);
+		// Terminate iteration: reset #it and old n value #on and decrease operation count:
+		if (found) it=-1, on=0, --state.m.c;
+	}
+	// Scroll the history such that the target line is visible and place the cursor.
+	int const scroll = y < 0 ? y : max(0, y - term.row + 1);
+	applyPos((Pos){.p={x, y - scroll, alt ? 0 : rangeY(histOff + scroll)}});
+}
+
 ExitState executeMotion(char const cs, KeySym const *const ks) {
 	state.m.c = state.m.c < 1u ? 1u : state.m.c;
 	if      (ks && *ks == XK_d) historyMove(0, 0, term.row / 2);
@@ -129,21 +166,8 @@ ExitState executeMotion(char const cs, KeySym const *const ks) {
 	else if (cs == 'n' || cs == 'N') {
 		int const d = ((cs=='N')!=(state.m.search==bw))?-1:1;
 		for (uint32_t i = state.m.c; i && findString(d, 0); --i);
-	} else if (contains(cs, "wWeEbB", 6)) {
-		int const low=cs<=90, off=tolower(cs)!='w', sgn=(tolower(cs)=='b')?-1:1;
-		size_t const l=strlen(wDelL), s=strlen(wDelS), maxIt=rows()*term.col;
-		for (int it=0, on=0; state.m.c > 0 && it < maxIt; ++it) {
-		    // If an offset is to be performed in beginning or not in beginning, move in history.
-			if ((off || it) && historyMove(sgn, 0, 0)) break;
-			// Determine if the category of the current letter changed since last iteration.
-			int n = 1<<(contains(cChar(),wDelS,s) ?(2-low) :!contains(cChar(),wDelL,l)),
-			    found = (on|=n)^n && ((off ?on^n :n)!=1);
-			// If a reverse offset is to be performed and this is the last letter:
-			if (found && off) historyMove(-sgn, 0, 0);
-			// Terminate iteration: reset #it and old n value #on and decrease operation count:
-			if (found) it=-1, on=0, --state.m.c;
-		}
-	} else return failed;
+	} else if (contains(cs, "wWeEbB", 6)) wordMotion(cs);
+	else return failed;
 	state.m.c = 0;
 	return state.cmd.op == yank ? exitMotion : success;
 }
@@ -231,7 +255,7 @@ ExitState kPressHist(char const *cs, size_t len, int ctrl, KeySym const *kSym) {
 	}
 	if (result == exitOp || result == finish) {
 		if (state.cmd.op == yank) {
-			xsetsel(getsel());
+			xsetsel(seltext());
 			xclipcopy();
 		}
 		state = defaultNormalMode;
@@ -1,5 +1,4 @@
 /* See LICENSE for license details. */
-#include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -11,10 +10,12 @@
 #include <string.h>
 #include <signal.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
@@ -36,13 +37,16 @@
 #define ESC_ARG_SIZ   16
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
+#define LATSAMPLES    1024
 
 /* macros */
 #define IS_SET(flag)		((term.mode & (flag)) != 0)
 #define ISCONTROLC0(c)		(BETWEEN(c, 0, 0x1f) || (c) == 0x7f)
 #define ISCONTROLC1(c)		(BETWEEN(c, 0x80, 0x9f))
 #define ISCONTROL(c)		(ISCONTROLC0(c) || ISCONTROLC1(c))
-#define ISDELIM(u)		(u && wcschr(worddelimiters, u))
+#define ISDELIM(u)		(wordclass(u) & WC_DELIM)
+/* number of blinking cells of a line, kept in a glyph in front of it */
+#define LINEBLINK(l)		((l)[-1].u)
 static inline int max(int a, int b) { return a > b ? a : b; }
 static inline int min(int a, int b) { return a < b ? a : b; }
 
@@ -77,14 +81,62 @@ enum charset {
 	CS_FIN
 };
 
+enum word_class {
+	WC_SPACE = 1, /* wDelL */
+	WC_WORD  = 2,
+	WC_PUNCT = 4, /* wDelS */
+	WC_DELIM = 8, /* worddelimiters */
+};
+
+/* parser states, after the DEC parser on vt100.net */
 enum escape_state {
-	ESC_START      = 1,
-	ESC_CSI        = 2,
-	ESC_STR        = 4,  /* DCS, OSC, PM, APC */
-	ESC_ALTCHARSET = 8,
-	ESC_STR_END    = 16, /* a final string was encountered */
-	ESC_TEST       = 32, /* Enter in test mode */
-	ESC_UTF8       = 64,
+	ESC_GROUND,
+	ESC_ESCAPE,
+	ESC_ESCINTER,   /* ESC and intermediates: charsets, tests, UTF-8 */
+	ESC_CSIENTRY,
+	ESC_CSIPARAM,
+	ESC_CSIINTER,
+	ESC_CSIIGNORE,  /* malformed CSI, swallowed up to its final */
+	ESC_STR,        /* DCS, OSC, PM, APC */
+	ESC_STREND,     /* ESC within a string, ST if '\\' follows */
+	ESC_LAST
+};
+
+enum escape_action {
+	EA_IGNORE,
+	EA_PRINT,
+	EA_EXECUTE,
+	EA_CLEAR,
+	EA_COLLECT,
+	EA_PARAM,
+	EA_ESCDISPATCH,
+	EA_CSIDISPATCH,
+	EA_STRSTART,
+	EA_STRPUT,
+	EA_STRDISPATCH,
+};
+
+enum escape_class {
+	CC_C0,
+	CC_BEL,
+	CC_CAN,      /* CAN, SUB */
+	CC_ESC,
+	CC_DEL,
+	CC_INTER,    /* 0x20-0x2f */
+	CC_DIGIT,
+	CC_SEP,      /* ; */
+	CC_COLON,
+	CC_PRIV,     /* 0x3c-0x3f */
+	CC_CSI,      /* [ */
+	CC_STRSTART, /* P ] ^ _ k */
+	CC_BSL,      /* \ */
+	CC_FINAL,    /* rest of 0x40-0x7e */
+	CC_C1,
+	CC_C1CSI,
+	CC_C1STR,    /* DCS, OSC, PM, APC */
+	CC_C1ST,
+	CC_PRINT,    /* 0xa0 and up */
+	CC_LAST
 };
 
 typedef struct {
@@ -94,6 +146,25 @@ typedef struct {
 	char state;
 } TCursor;
 
+typedef struct {
+	Rune u;
+	uchar cls;
+} WordClass;
+
+/* copy of a selection handed to the clipboard, see seltext() */
+struct SelText {
+	int type;      /* selection type */
+	int start;     /* first line in buf */
+	int n;         /* nb lines */
+	int bx, ex;    /* first and last selected column */
+	int col;       /* nb col when copied */
+	char **line;   /* encoded lines, NULL while still read from buf */
+	int lazy;      /* nb lines still read from buf */
+	int ref;
+	Line *buf;     /* history of the session it was copied from */
+	SelText *next; /* next text with lazy lines */
+};
+
 typedef struct {
 	int mode;
 	int type;
@@ -119,6 +190,7 @@ typedef struct {
 	int col;      /* nb col */
 	Line *line;   /* screen */
 	Line *alt;    /* alternate screen */
+	Line *altring; /* twice the rows, the alternate screen slides in it */
 	int *dirty;   /* dirtyness of lines */
 	TCursor c;    /* cursor */
 	int ocx;      /* old cursor col */
@@ -126,7 +198,7 @@ typedef struct {
 	int top;      /* top    scroll limit */
 	int bot;      /* bottom scroll limit */
 	int mode;     /* terminal mode flags */
-	int esc;      /* escape state flags */
+	int esc;      /* escape parser state */
 	char trantbl[4]; /* charset table translation */
 	int charset;  /* current charset */
 	int icharset; /* selected charset for sequence */
@@ -134,15 +206,13 @@ typedef struct {
 	Rune lastc;   /* last printed char outside of sequence, 0 if control */
 } Term;
 
-/* CSI Escape sequence structs */
+/* CSI Escape sequence structs, also used for ESC with intermediates */
 /* ESC '[' [[ [<priv>] <arg> [;]] <mode> [<mode>]] */
 typedef struct {
-	char buf[ESC_BUF_SIZ]; /* raw string */
-	size_t len;            /* raw string length */
-	char priv;
+	char priv;             /* private marker, one of <=>? */
 	int arg[ESC_ARG_SIZ];
-	int narg;              /* nb of args */
-	char mode[2];
+	int narg;              /* nb of args, the current one while parsing */
+	char mode[2];          /* intermediate and final, or final */
 } CSIEscape;
 
 /* STR Escape sequence structs */
@@ -156,16 +226,33 @@ typedef struct {
 	int narg;              /* nb of args */
 } STREscape;
 
+/* history lines treflow() left at their width, see treflowrest() */
+typedef struct {
+	Line *line;
+	int n;
+	int col;
+	Glyph pad;             /* blank of the lines made of them */
+} Reflow;
+
+/* a place in the lines rewrapped by reflow() */
+typedef struct {
+	int y, x;              /* in the old lines */
+	int pad;               /* blanks up to it are added */
+	int ny, nx;            /* in the new lines */
+} ReflowPos;
+
 static void execsh(char *, char **);
 static void stty(char **);
 static void sigchld(int);
 static void ttywriteraw(const char *, size_t);
+static void recordwrite(uint32_t, const char *, size_t);
+static void replay(char *, int, int);
 
 static void csidump(void);
 static void csihandle(void);
-static void csiparse(void);
+static void csiparam(uchar);
 static void csireset(void);
-static int eschandle(uchar);
+static void eschandle(uchar);
 static void strdump(void);
 static void strhandle(void);
 static void strparse(void);
@@ -186,16 +273,31 @@ static void tmoveato(int, int);
 static void tnewline(int);
 static void tputtab(int);
 static void tputc(Rune);
+static void trepeat(Rune, int);
+static uchar escclass(Rune);
+static int tsgr(const char *, int);
+static void tparse(Rune, char *, int);
 static void treset(void);
 static void tscrollup(int, int);
 static void tscrolldown(int, int);
 static void tsetattr(int *, int);
 static void tsetchar(Rune, Glyph *, int, int);
+static Line linealloc(Line, int, int);
+static int selspans(int, int, int [2][2]);
+static int selinspans(int, int [2][2], int);
+static void seldirt(int, int);
+static void linefree(Line);
+static void tlineblink(int);
 static void tsetdirt(int, int);
+static void tscrolldirt(int, int);
+static void tsyncbuf(int, int);
+static void treflowrest(void);
+static void tdeferuse(int);
+static int tslide(int, int);
+static void drawblits(void);
 static void tsetscroll(int, int);
 static void tswapscreen(void);
 static void tsetmode(int, int, int *, int);
-static int twrite(const char *, int, int);
 static void tcontrolcode(uchar );
 static void tdectest(char );
 static void tdefutf8(char);
@@ -207,6 +309,13 @@ static void drawregion(int, int, int, int);
 
 static void selnormalize(void);
 static void selscroll(int, int);
+static size_t seltextenc(const SelText *, Line, int);
+static void seltextkeepline(SelText *, int, Line);
+static void seltextkeep(Line *, int, int);
+static void wordclassinit(void);
+static void wordclassset(Rune, int);
+static int wordclass(Rune);
+static int wordclasscmp(const void *, const void *);
 
 static size_t utf8decode(const char *, Rune *, size_t);
 static Rune utf8decodebyte(char, size_t *);
@@ -216,30 +325,203 @@ static size_t utf8validate(Rune *, size_t);
 static char *base64dec(const char *);
 static char base64dec_getc(const char **);
 
-static ssize_t xwrite(int, const char *, size_t);
-
 /* Globals */
 static Term term;
 static Selection sel;
 static CSIEscape csiescseq;
 static STREscape strescseq;
+static SelText *seltexts;
+static char *seltextbuf;
+static size_t seltextbufsiz;
+static uchar wcascii[128];
+static WordClass *wcmap;
+static size_t wcmaplen;
+static struct {
+	int stage;                       /* next stage expected, 0 if idle */
+	struct timespec t[LAT_LAST];
+	float ms[LAT_LAST][LATSAMPLES];  /* since the key press, per stage */
+	int n;                           /* traces completed */
+} lat;
+#ifdef PROFILE
+static struct {
+	ulong calls;
+	double ms;
+} prof[PROF_LAST];
+#endif
 static int iofd = 1;
 static int cmdfd;
+static int recfd = -1; /* see ttyrecord() */
+static struct timespec rec0;
+static int replaying;
+static char *wbuf; /* bytes queued for the tty, see ttywriteraw() */
+static size_t wlen, woff, wsiz;
+static char *rbuf; /* read bytes not parsed yet, see ttyread() */
+static int rlen;
+static int ttyend; /* the tty was closed, see ttyended() */
 static pid_t pid;
+static int attached; /* the tty was taken over with tload() */
+static int reaped; /* the child was waited for, see sigchld() */
+static Glyph *blank; /* see tclearregion() */
+static int blits[16][3]; /* region scrolls not drawn yet: top, bot, n */
+static int nblits;
+static int blankcols;
 
 static uchar utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static uchar utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
 static Rune utfmin[UTF_SIZ + 1] = {       0,    0,  0x80,  0x800,  0x10000};
 static Rune utfmax[UTF_SIZ + 1] = {0x10FFFF, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
 
+/* action << 4 | next state, by state and escclass() of the character */
+#define T(a, s) (EA_##a << 4 | ESC_##s)
+static const uchar esctrans[ESC_LAST][CC_LAST] = {
+	[ESC_GROUND] = {
+		/* C0, BEL, CAN, ESC, DEL */
+		T(EXECUTE, GROUND), T(EXECUTE, GROUND), T(EXECUTE, GROUND),
+		T(CLEAR, ESCAPE), T(IGNORE, GROUND),
+		/* INTER, DIGIT, SEP, COLON, PRIV, CSI, STRSTART, BSL, FINAL */
+		T(PRINT, GROUND), T(PRINT, GROUND), T(PRINT, GROUND),
+		T(PRINT, GROUND), T(PRINT, GROUND), T(PRINT, GROUND),
+		T(PRINT, GROUND), T(PRINT, GROUND), T(PRINT, GROUND),
+		/* C1, C1CSI, C1STR, C1ST, PRINT */
+		T(EXECUTE, GROUND), T(CLEAR, CSIENTRY), T(STRSTART, STR),
+		T(IGNORE, GROUND), T(PRINT, GROUND),
+	},
+	[ESC_ESCAPE] = {
+		T(EXECUTE, ESCAPE), T(EXECUTE, ESCAPE), T(EXECUTE, GROUND),
+		T(CLEAR, ESCAPE), T(IGNORE, ESCAPE),
+		T(COLLECT, ESCINTER), T(ESCDISPATCH, GROUND),
+		T(ESCDISPATCH, GROUND), T(ESCDISPATCH, GROUND),
+		T(ESCDISPATCH, GROUND), T(IGNORE, CSIENTRY), T(STRSTART, STR),
+		T(ESCDISPATCH, GROUND), T(ESCDISPATCH, GROUND),
+		T(EXECUTE, GROUND), T(CLEAR, CSIENTRY), T(STRSTART, STR),
+		T(IGNORE, GROUND), T(IGNORE, GROUND),
+	},
+	[ESC_ESCINTER] = {
+		T(EXECUTE, ESCINTER), T(EXECUTE, ESCINTER), T(EXECUTE, GROUND),
+		T(CLEAR, ESCAPE), T(IGNORE, ESCINTER),
+		T(COLLECT, ESCINTER), T(ESCDISPATCH, GROUND),
+		T(ESCDISPATCH, GROUND), T(ESCDISPATCH, GROUND),
+		T(ESCDISPATCH, GROUND), T(ESCDISPATCH, GROUND),
+		T(ESCDISPATCH, GROUND), T(ESCDISPATCH, GROUND),
+		T(ESCDISPATCH, GROUND),
+		T(EXECUTE, GROUND), T(CLEAR, CSIENTRY), T(STRSTART, STR),
+		T(IGNORE, GROUND), T(IGNORE, GROUND),
+	},
+	[ESC_CSIENTRY] = {
+		T(EXECUTE, CSIENTRY), T(EXECUTE, CSIENTRY), T(EXECUTE, GROUND),
+		T(CLEAR, ESCAPE), T(IGNORE, CSIENTRY),
+		T(COLLECT, CSIINTER), T(PARAM, CSIPARAM), T(PARAM, CSIPARAM),
+		T(IGNORE, CSIIGNORE), T(COLLECT, CSIPARAM),
+		T(CSIDISPATCH, GROUND), T(CSIDISPATCH, GROUND),
+		T(CSIDISPATCH, GROUND), T(CSIDISPATCH, GROUND),
+		T(EXECUTE, GROUND), T(CLEAR, CSIENTRY), T(STRSTART, STR),
+		T(IGNORE, GROUND), T(IGNORE, CSIIGNORE),
+	},
+	[ESC_CSIPARAM] = {
+		T(EXECUTE, CSIPARAM), T(EXECUTE, CSIPARAM), T(EXECUTE, GROUND),
+		T(CLEAR, ESCAPE), T(IGNORE, CSIPARAM),
+		T(COLLECT, CSIINTER), T(PARAM, CSIPARAM), T(PARAM, CSIPARAM),
+		T(IGNORE, CSIIGNORE), T(IGNORE, CSIIGNORE),
+		T(CSIDISPATCH, GROUND), T(CSIDISPATCH, GROUND),
+		T(CSIDISPATCH, GROUND), T(CSIDISPATCH, GROUND),
+		T(EXECUTE, GROUND), T(CLEAR, CSIENTRY), T(STRSTART, STR),
+		T(IGNORE, GROUND), T(IGNORE, CSIIGNORE),
+	},
+	[ESC_CSIINTER] = {
+		T(EXECUTE, CSIINTER), T(EXECUTE, CSIINTER), T(EXECUTE, GROUND),
+		T(CLEAR, ESCAPE), T(IGNORE, CSIINTER),
+		T(COLLECT, CSIINTER), T(IGNORE, CSIIGNORE), T(IGNORE, CSIIGNORE),
+		T(IGNORE, CSIIGNORE), T(IGNORE, CSIIGNORE),
+		T(CSIDISPATCH, GROUND), T(CSIDISPATCH, GROUND),
+		T(CSIDISPATCH, GROUND), T(CSIDISPATCH, GROUND),
+		T(EXECUTE, GROUND), T(CLEAR, CSIENTRY), T(STRSTART, STR),
+		T(IGNORE, GROUND), T(IGNORE, CSIIGNORE),
+	},
+	[ESC_CSIIGNORE] = {
+		T(EXECUTE, CSIIGNORE), T(EXECUTE, CSIIGNORE), T(EXECUTE, GROUND),
+		T(CLEAR, ESCAPE), T(IGNORE, CSIIGNORE),
+		T(IGNORE, CSIIGNORE), T(IGNORE, CSIIGNORE), T(IGNORE, CSIIGNORE),
+		T(IGNORE, CSIIGNORE), T(IGNORE, CSIIGNORE),
+		T(IGNORE, GROUND), T(IGNORE, GROUND),
+		T(IGNORE, GROUND), T(IGNORE, GROUND),
+		T(EXECUTE, GROUND), T(CLEAR, CSIENTRY), T(STRSTART, STR),
+		T(IGNORE, GROUND), T(IGNORE, CSIIGNORE),
+	},
+	[ESC_STR] = {
+		T(STRPUT, STR), T(STRDISPATCH, GROUND), T(EXECUTE, GROUND),
+		T(CLEAR, STREND), T(STRPUT, STR),
+		T(STRPUT, STR), T(STRPUT, STR), T(STRPUT, STR),
+		T(STRPUT, STR), T(STRPUT, STR), T(STRPUT, STR),
+		T(STRPUT, STR), T(STRPUT, STR), T(STRPUT, STR),
+		T(EXECUTE, GROUND), T(CLEAR, CSIENTRY), T(STRSTART, STR),
+		T(STRDISPATCH, GROUND), T(STRPUT, STR),
+	},
+	[ESC_STREND] = {
+		T(EXECUTE, STREND), T(STRDISPATCH, ESCAPE), T(EXECUTE, GROUND),
+		T(CLEAR, ESCAPE), T(IGNORE, STREND),
+		T(COLLECT, ESCINTER), T(ESCDISPATCH, GROUND),
+		T(ESCDISPATCH, GROUND), T(ESCDISPATCH, GROUND),
+		T(ESCDISPATCH, GROUND), T(IGNORE, CSIENTRY), T(STRSTART, STR),
+		T(STRDISPATCH, GROUND), T(ESCDISPATCH, GROUND),
+		T(EXECUTE, GROUND), T(CLEAR, CSIENTRY), T(STRSTART, STR),
+		T(IGNORE, GROUND), T(IGNORE, GROUND),
+	},
+};
+#undef T
+
 int buffCols;
 extern int const buffSize;
 int histOp, histMode, histOff, insertOff, altToggle, *mark;
 Line *buf = NULL;
 static TCursor c[3];
+static Reflow *defer;  /* oldest first */
+static int ndefer;
+static int deferh;     /* oldest lines of buf waiting for defer */
+static Line deferline; /* the blank those lines share until then */
 static inline int rows() { return IS_SET(MODE_ALTSCREEN) ? term.row : buffSize;}
 static inline int rangeY(int i) { while (i < 0) i += rows(); return i % rows();}
 
+/*
+ * A session is a terminal of its own: tty, screen, history and parser.
+ * The current one lives in the globals above, the others are kept here
+ * until tswitch() swaps them in. SESSION lists what is swapped.
+ */
+#define SESSION(X) \
+	X(term) X(sel) X(csiescseq) X(strescseq) X(buf) X(mark) X(c) \
+	X(buffCols) X(histOp) X(histMode) X(histOff) X(insertOff) \
+	X(altToggle) X(iofd) X(cmdfd) X(recfd) X(rec0) X(replaying) \
+	X(wbuf) X(wlen) X(woff) X(wsiz) X(rbuf) X(rlen) X(ttyend) X(pid) \
+	X(attached) X(reaped) X(blits) X(nblits) X(defer) X(ndefer) \
+	X(deferh) X(deferline)
+
+typedef struct {
+	Term term;
+	Selection sel;
+	CSIEscape csiescseq;
+	STREscape strescseq;
+	Line *buf;
+	int *mark;
+	TCursor c[3];
+	int buffCols, histOp, histMode, histOff, insertOff, altToggle;
+	int iofd, cmdfd, recfd;
+	struct timespec rec0;
+	int replaying;
+	char *wbuf;
+	size_t wlen, woff, wsiz;
+	char *rbuf;
+	int rlen, ttyend;
+	pid_t pid;
+	int attached, reaped;
+	int blits[16][3], nblits;
+	Reflow *defer;
+	int ndefer, deferh;
+	Line deferline;
+	int used;
+} Session;
+
+static Session sess[MAXSESSIONS] = { [0].used = 1 };
+static int cursess, nsess = 1;
+
 ssize_t
 xwrite(int fd, const char *s, size_t len)
 {
@@ -257,6 +539,24 @@ xwrite(int fd, const char *s, size_t len)
 	return aux;
 }
 
+/* read all of len bytes, -1 if the file ends before */
+ssize_t
+xread(int fd, char *s, size_t len)
+{
+	size_t aux = len;
+	ssize_t r;
+
+	while (len > 0) {
+		r = read(fd, s, len);
+		if (r <= 0)
+			return -1;
+		len -= r;
+		s += r;
+	}
+
+	return aux;
+}
+
 void *
 xmalloc(size_t len)
 {
@@ -416,6 +716,79 @@ selinit(void)
 	sel.mode = SEL_IDLE;
 	sel.snap = 0;
 	sel.ob.x = -1;
+	wordclassinit();
+}
+
+/*
+ * Classify every rune named in the configuration once, so word motions
+ * and snapping look classes up instead of scanning delimiter strings:
+ * ASCII through a flat table, anything else through a sorted map.
+ */
+void
+wordclassinit(void)
+{
+	const char *d;
+	const wchar_t *w;
+	Rune u;
+	size_t len;
+
+	memset(wcascii, WC_WORD, sizeof(wcascii));
+	for (w = worddelimiters; *w; w++)
+		wordclassset(*w, WC_WORD | WC_DELIM);
+	for (d = wDelL; *d; d += len) {
+		if (!(len = utf8decode(d, &u, UTF_SIZ)))
+			break;
+		wordclassset(u, WC_SPACE);
+	}
+	for (d = wDelS; *d; d += len) {
+		if (!(len = utf8decode(d, &u, UTF_SIZ)))
+			break;
+		wordclassset(u, WC_PUNCT);
+	}
+	if (wcmaplen)
+		qsort(wcmap, wcmaplen, sizeof(*wcmap), wordclasscmp);
+}
+
+void
+wordclassset(Rune u, int cls)
+{
+	uchar *p = NULL;
+	size_t i;
+
+	if (u < LEN(wcascii)) {
+		p = &wcascii[u];
+	} else {
+		for (i = 0; i < wcmaplen && !p; i++) {
+			if (wcmap[i].u == u)
+				p = &wcmap[i].cls;
+		}
+		if (!p) {
+			wcmap = xrealloc(wcmap, (wcmaplen + 1) * sizeof(*wcmap));
+			wcmap[wcmaplen] = (WordClass){ .u = u, .cls = WC_WORD };
+			p = &wcmap[wcmaplen++].cls;
+		}
+	}
+	/* the delimiter flag is kept, the word class is replaced */
+	*p = (*p & WC_DELIM) | cls;
+}
+
+int
+wordclasscmp(const void *a, const void *b)
+{
+	Rune ua = ((const WordClass *)a)->u, ub = ((const WordClass *)b)->u;
+
+	return (ua > ub) - (ua < ub);
+}
+
+int
+wordclass(Rune u)
+{
+	WordClass key = { .u = u }, *wc;
+
+	if (u < LEN(wcascii))
+		return wcascii[u];
+	wc = bsearch(&key, wcmap, wcmaplen, sizeof(*wcmap), wordclasscmp);
+	return wc ? wc->cls : WC_WORD;
 }
 
 int
@@ -446,6 +819,7 @@ void historyOpToggle(int start, int paint) {
 }
 
 void historyModeToggle(int start) {
+	if (start) treflowrest();
 	if (!(histMode = (histOp = !!start))) {
 		selnormalize();
 		tfulldirt();
@@ -464,6 +838,12 @@ int historyBufferScroll(int n) {
 		memmove(&term.dirty[-min(n,0)], &term.dirty[max(n,0)], s*r);
 		memset(&term.dirty[n>0 ? r : 0], 0, s * p);
 	}
+	// Keep copied selections of history lines that are about to be reused.
+	if (!histOp && seltexts)
+		seltextkeep(buf, n > 0 ? insertOff + term.row : insertOff + n,
+				p);
+	// Lines left by treflow() are rewrapped before the newest is shown.
+	if (!histOp && n < 0) treflowrest(); else if (!histOp) tdeferuse(p);
 	term.line = &buf[*ptr = (buffSize+*ptr+n) % buffSize];
 	// Cut part of selection removed from buffer, and update sel.ne/b.
 	int const prevOffBuf = sel.alt ? 0 : insertOff + term.row;
@@ -479,7 +859,7 @@ int historyBufferScroll(int n) {
 	}
 	selnormalize();
   // Clear the new region exposed by the shift.
-	if (!histOp) tclearregion(0, n>0?r+1:0, buffCols-1, n>0?term.row:p-1);
+	if (!histOp) tclearregion(0, n>0?r:0, buffCols-1, n>0?term.row-1:p-1);
 	return 1;
 }
 
@@ -528,14 +908,7 @@ void selnormalize(void) {
 			if (cne) sel.ne.x = MAX(sel.ob.x, sel.oe.x);
 		}
 	}
-	int const nBet=sel.nb.y<=sel.ne.y, oBet=oldb<=olde;
-	for (int i = 0; i < term.row; ++i) {
-		int const n = nBet ? BETWEEN(i, sel.nb.y, sel.ne.y)
-		                   : OUT(i, sel.nb.y, sel.ne.y);
-		term.dirty[i] |= (sel.type == SEL_RECTANGULAR && n) ||
-		        (n != (oBet ? BETWEEN(i,oldb,olde) : OUT(i,oldb,olde)));
-
-	}
+	seldirt(oldb, olde);
 	if (BETWEEN(oldb, 0, term.row - 1)) term.dirty[oldb] = 1;
 	if (BETWEEN(olde, 0, term.row - 1)) term.dirty[olde] = 1;
 	if (BETWEEN(sel.nb.y, 0, term.row - 1)) term.dirty[sel.nb.y] = 1;
@@ -544,6 +917,73 @@ void selnormalize(void) {
 	historyOpToggle(-1, 1);
 }
 
+/* Split the screen rows from nb to ne, which may wrap around, into spans. */
+int
+selspans(int nb, int ne, int span[2][2])
+{
+	int i, n = 0;
+
+	if (nb < 0)
+		return 0;
+	if (nb <= ne) {
+		span[n][0] = nb, span[n++][1] = ne;
+	} else {
+		span[n][0] = 0, span[n++][1] = ne;
+		span[n][0] = nb, span[n++][1] = term.row - 1;
+	}
+	for (i = 0; i < n; i++) {
+		if (span[i][0] >= term.row || span[i][1] < span[i][0])
+			n--, span[i][0] = span[n][0], span[i--][1] = span[n][1];
+		else
+			span[i][1] = MIN(span[i][1], term.row - 1);
+	}
+	return n;
+}
+
+int
+selinspans(int y, int span[2][2], int n)
+{
+	while (n--) {
+		if (BETWEEN(y, span[n][0], span[n][1]))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Dirty the rows entering or leaving the selection, which spanned the rows
+ * from oldb to olde before: membership only changes at the ends of spans.
+ */
+void
+seldirt(int oldb, int olde)
+{
+	int o[2][2], s[2][2], no, ns, p[10], np = 0, i, j, t;
+
+	no = selspans(oldb, olde, o);
+	ns = selspans(sel.nb.y, sel.ne.y, s);
+
+	/* the columns of a rectangular selection apply to all its rows */
+	for (i = 0; sel.type == SEL_RECTANGULAR && i < ns; i++)
+		tsetdirt(s[i][0], s[i][1]);
+
+	p[np++] = 0;
+	p[np++] = term.row;
+	for (i = 0; i < no; i++)
+		p[np++] = o[i][0], p[np++] = o[i][1] + 1;
+	for (i = 0; i < ns; i++)
+		p[np++] = s[i][0], p[np++] = s[i][1] + 1;
+	for (i = 1; i < np; i++) {
+		for (j = i; j > 0 && p[j - 1] > p[j]; j--)
+			t = p[j], p[j] = p[j - 1], p[j - 1] = t;
+	}
+
+	for (i = 1; i < np; i++) {
+		if (p[i - 1] < p[i] && selinspans(p[i - 1], o, no) !=
+		                       selinspans(p[i - 1], s, ns))
+			tsetdirt(p[i - 1], p[i] - 1);
+	}
+}
+
 void
 selstart(int col, int row, int snap)
 {
@@ -575,75 +1015,254 @@ selextend(int col, int row, int type, int done)
 	sel.mode = done ? SEL_IDLE : SEL_READY;
 }
 
+/* Columns x1 to x2 of row y are selected, none if it returns 0. */
 int
-selected(int x, int y)
+selrow(int y, int *x1, int *x2)
 {
 	if (sel.mode == SEL_EMPTY || sel.ob.x == -1 ||
 			sel.alt != IS_SET(MODE_ALTSCREEN))
 		return 0;
 
-	if (sel.type == SEL_RECTANGULAR)
-		return BETWEEN(y, sel.nb.y, sel.ne.y)
-		    && BETWEEN(x, sel.nb.x, sel.ne.x);
+	if (sel.type == SEL_RECTANGULAR) {
+		if (!BETWEEN(y, sel.nb.y, sel.ne.y))
+			return 0;
+		*x1 = sel.nb.x;
+		*x2 = sel.ne.x;
+		return 1;
+	}
 
-	return ((sel.nb.y > sel.ne.y) ? OUT(y, sel.nb.y, sel.ne.y)
-	                              : BETWEEN(y, sel.nb.y, sel.ne.y)) &&
-	       (y != sel.nb.y || x >= sel.nb.x) &&
-	       (y != sel.ne.y || x <= sel.ne.x);
+	if (!((sel.nb.y > sel.ne.y) ? OUT(y, sel.nb.y, sel.ne.y)
+	                            : BETWEEN(y, sel.nb.y, sel.ne.y)))
+		return 0;
+	*x1 = (y == sel.nb.y) ? sel.nb.x : 0;
+	*x2 = (y == sel.ne.y) ? sel.ne.x : INT_MAX;
+	return 1;
 }
 
-char *
-getsel(void)
+int
+selected(int x, int y)
 {
-	char *str, *ptr;
-	int y, yy, bufsize, lastx;
-	Glyph *gp, *last;
+	int x1, x2;
+
+	return selrow(y, &x1, &x2) && BETWEEN(x, x1, x2);
+}
+
+/*
+ * A selection is copied lazily: lines still shown on the screen, which the
+ * application may rewrite, are encoded right away, while lines from the
+ * history are encoded from buf on demand and only kept in memory once the
+ * history is about to reuse them (see seltextkeep()).
+ */
+SelText *
+seltext(void)
+{
+	SelText *t;
+	Line *cbuf = IS_SET(MODE_ALTSCREEN) ? term.line : buf;
+	int i, yy, start, endy, h = rows();
 
 	if (sel.ob.x == -1)
 		return NULL;
 
-	int const start = sel.swap ? sel.oe.y : sel.ob.y, h = rows();
-	int endy = (sel.swap ? sel.ob.y : sel.oe.y);
+	start = sel.swap ? sel.oe.y : sel.ob.y;
+	endy = sel.swap ? sel.ob.y : sel.oe.y;
 	for (; endy < start; endy += h);
-	Line * const cbuf = IS_SET(MODE_ALTSCREEN) ? term.line : buf;
-	bufsize = (term.col+1) * (endy-start+1 ) * UTF_SIZ;
-	assert(bufsize > 0);
-	ptr = str = xmalloc(bufsize);
-
-	/* append every set & selected glyph to the selection */
-	for (y = start; y <= endy; y++) {
-		yy = y % h;
-
-		if (sel.type == SEL_RECTANGULAR) {
-			gp = &cbuf[yy][sel.nb.x];
-			lastx = sel.ne.x;
+
+	t = xmalloc(sizeof(*t));
+	*t = (SelText){
+		.type = sel.type, .start = start % h, .n = endy - start + 1,
+		.bx = sel.nb.x, .ex = sel.ne.x, .col = term.col, .ref = 1,
+		.buf = buf
+	};
+	t->line = xmalloc(t->n * sizeof(*t->line));
+	for (i = 0; i < t->n; i++) {
+		yy = (t->start + i) % h;
+		t->line[i] = NULL;
+		if (IS_SET(MODE_ALTSCREEN) || rangeY(yy - insertOff) < term.row)
+			seltextkeepline(t, i, cbuf[yy]);
+		else
+			t->lazy++;
+	}
+	if (t->lazy) {
+		t->next = seltexts;
+		seltexts = t;
+	}
+
+	return t;
+}
+
+SelText *
+seltextstr(char *s)
+{
+	SelText *t;
+
+	if (!s)
+		return NULL;
+	t = xmalloc(sizeof(*t));
+	*t = (SelText){ .n = 1, .ref = 1 };
+	t->line = xmalloc(sizeof(*t->line));
+	t->line[0] = s;
+
+	return t;
+}
+
+SelText *
+seltextref(SelText *t)
+{
+	if (t)
+		t->ref++;
+	return t;
+}
+
+void
+seltextfree(SelText *t)
+{
+	SelText **tp;
+	int i;
+
+	if (!t || --t->ref > 0)
+		return;
+	for (tp = &seltexts; *tp; tp = &(*tp)->next) {
+		if (*tp == t) {
+			*tp = t->next;
+			break;
+		}
+	}
+	for (i = 0; i < t->n; i++)
+		free(t->line[i]);
+	free(t->line);
+	free(t);
+}
+
+/*
+ * Copy up to len bytes of the text, starting at byte *off of line *y, and
+ * advance both. Returns 0 once the whole text has been read.
+ */
+size_t
+seltextread(SelText *t, int *y, size_t *off, char *dst, size_t len)
+{
+	const char *s;
+	size_t n, slen, done = 0;
+
+	for (; *y < t->n && done < len; ++*y, *off = 0) {
+		if ((s = t->line[*y])) {
+			slen = strlen(s);
 		} else {
-			gp = &cbuf[yy][start == y ? sel.nb.x : 0];
-			lastx = (endy == y) ? sel.ne.x : term.col-1;
+			slen = seltextenc(t,
+					t->buf[(t->start + *y) % buffSize], *y);
+			s = seltextbuf;
+		}
+		n = MIN(slen - *off, len - done);
+		memcpy(dst + done, s + *off, n);
+		done += n;
+		if (*off + n < slen) {
+			*off += n;
+			break;
 		}
-		last = &cbuf[yy][lastx];
-		if (!(cbuf[yy][term.col - 1].mode & ATTR_WRAP))
-			while (last > gp && last->u == ' ') --last;
+	}
+
+	return done;
+}
+
+/* encode line i of the text from l into seltextbuf */
+size_t
+seltextenc(const SelText *t, Line l, int i)
+{
+	char *ptr;
+	int lastx;
+	Glyph *gp, *last;
+
+	if (seltextbufsiz < t->col * UTF_SIZ + 1) {
+		seltextbufsiz = t->col * UTF_SIZ + 1;
+		seltextbuf = xrealloc(seltextbuf, seltextbufsiz);
+	}
+	ptr = seltextbuf;
+
+	if (t->type == SEL_RECTANGULAR) {
+		gp = &l[t->bx];
+		lastx = t->ex;
+	} else {
+		gp = &l[i == 0 ? t->bx : 0];
+		lastx = (i == t->n - 1) ? t->ex : t->col - 1;
+	}
+	last = &l[lastx];
+	if (!(l[t->col - 1].mode & ATTR_WRAP))
+		while (last > gp && last->u == ' ') --last;
+
+	for ( ; gp <= last; ++gp) {
+		if (gp->mode & ATTR_WDUMMY) continue;
+		ptr += utf8encode(gp->u, ptr);
+	}
+
+	/*
+	 * Copy and pasting of line endings is inconsistent
+	 * in the inconsistent terminal and GUI world.
+	 * The best solution seems like to produce '\n' when
+	 * something is copied from st and convert '\n' to
+	 * '\r', when something to be pasted is received by
+	 * st.
+	 * FIXME: Fix the computer world.
+	 */
+	if ((i < t->n - 1 || lastx == t->col - 1) &&
+	    (!(last->mode & ATTR_WRAP) || t->type == SEL_RECTANGULAR))
+		*ptr++ = '\n';
+
+	return ptr - seltextbuf;
+}
+
+void
+seltextkeepline(SelText *t, int i, Line l)
+{
+	size_t len = seltextenc(t, l, i);
+
+	t->line[i] = xmalloc(len + 1);
+	memcpy(t->line[i], seltextbuf, len);
+	t->line[i][len] = '\0';
+}
+
+/* keep the lines y to y+n-1 of the history b, they are about to be reused */
+void
+seltextkeep(Line *b, int y, int n)
+{
+	SelText *t, **tp;
+	int i, j;
 
-		for ( ; gp <= last; ++gp) {
-			if (gp->mode & ATTR_WDUMMY) continue;
-			ptr += utf8encode(gp->u, ptr);
+	for (tp = &seltexts; (t = *tp); ) {
+		for (j = 0; j < n && t->lazy && t->buf == b; j++) {
+			i = ((y + j - t->start) % buffSize + buffSize) % buffSize;
+			if (i < t->n && !t->line[i]) {
+				seltextkeepline(t, i,
+						b[(t->start + i) % buffSize]);
+				t->lazy--;
+			}
 		}
+		if (t->lazy)
+			tp = &t->next;
+		else
+			*tp = t->next;
+	}
+}
 
-		/*
-		 * Copy and pasting of line endings is inconsistent
-		 * in the inconsistent terminal and GUI world.
-		 * The best solution seems like to produce '\n' when
-		 * something is copied from st and convert '\n' to
-		 * '\r', when something to be pasted is received by
-		 * st.
-		 * FIXME: Fix the computer world.
-		 */
-		if ((y < endy || lastx == term.col - 1) &&
-		    (!(last->mode & ATTR_WRAP) || sel.type == SEL_RECTANGULAR))
-			*ptr++ = '\n';
+char *
+getsel(void)
+{
+	SelText *t;
+	char *str = NULL;
+	size_t len = 0, siz = 0, off = 0;
+	int y = 0;
+
+	if (!(t = seltext()))
+		return NULL;
+
+	while (y < t->n) {
+		siz = siz ? 2 * siz : BUFSIZ;
+		str = xrealloc(str, siz);
+		len += seltextread(t, &y, &off, str + len, siz - len - 1);
 	}
-	*ptr = 0;
+	seltextfree(t);
+	if (!str)
+		str = xmalloc(1);
+	str[len] = '\0';
+
 	return str;
 }
 
@@ -673,6 +1292,7 @@ execsh(char *cmd, char **args)
 {
 	char *sh, *prog, *arg;
 	const struct passwd *pw;
+	sigset_t set;
 
 	errno = 0;
 	if ((pw = getpwuid(getuid())) == NULL) {
@@ -715,6 +1335,8 @@ execsh(char *cmd, char **args)
 	signal(SIGQUIT, SIG_DFL);
 	signal(SIGTERM, SIG_DFL);
 	signal(SIGALRM, SIG_DFL);
+	sigemptyset(&set);
+	sigprocmask(SIG_SETMASK, &set, NULL);
 
 	execvp(prog, args);
 	_exit(1);
@@ -723,20 +1345,27 @@ execsh(char *cmd, char **args)
 void
 sigchld(int a)
 {
-	int stat;
+	int stat, i;
 	pid_t p;
 
-	if ((p = waitpid(pid, &stat, WNOHANG)) < 0)
-		die("waiting for pid %hd failed: %s\n", pid, strerror(errno));
-
-	if (pid != p)
-		return;
-
-	if (WIFEXITED(stat) && WEXITSTATUS(stat))
-		die("child exited with status %d\n", WEXITSTATUS(stat));
-	else if (WIFSIGNALED(stat))
-		die("child terminated due to signal %d\n", WTERMSIG(stat));
-	_exit(0);
+	while ((p = waitpid(-1, &stat, WNOHANG)) > 0) {
+		if (p == pid)
+			reaped = 1;
+		for (i = 0; i < MAXSESSIONS; i++) {
+			if (i != cursess && sess[i].used && sess[i].pid == p)
+				sess[i].reaped = 1;
+		}
+		/* other sessions are closed when their tty is */
+		if (p != pid || nsess > 1)
+			continue;
+		if (WIFEXITED(stat) && WEXITSTATUS(stat))
+			die("child exited with status %d\n",
+					WEXITSTATUS(stat));
+		else if (WIFSIGNALED(stat))
+			die("child terminated due to signal %d\n",
+					WTERMSIG(stat));
+		_exit(0);
+	}
 }
 
 void
@@ -784,6 +1413,7 @@ ttynew(char *line, char *cmd, char *out, char **args)
 			    line, strerror(errno));
 		dup2(cmdfd, 0);
 		stty(args);
+		fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
 		return cmdfd;
 	}
 
@@ -818,43 +1448,213 @@ ttynew(char *line, char *cmd, char *out, char **args)
 #endif
 		close(s);
 		cmdfd = m;
+		fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
 		signal(SIGCHLD, sigchld);
 		break;
 	}
 	return cmdfd;
 }
 
+/*
+ * A recording starts with RECMAGIC and the columns and rows of the
+ * terminal (uint32_t), followed by every chunk read from the tty as its
+ * time since the start in microseconds (uint64_t), its length (uint32_t)
+ * and its bytes, in host byte order. A chunk of length RECRESIZE holds
+ * the columns and rows the terminal was resized to instead.
+ */
+void
+ttyrecord(char *file)
+{
+	uint32_t size[2] = { term.col, term.row };
+
+	if ((recfd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+		die("open recording '%s' failed: %s\n", file, strerror(errno));
+	if (xwrite(recfd, RECMAGIC, sizeof(RECMAGIC) - 1) < 0 ||
+	    xwrite(recfd, (char *)size, sizeof(size)) < 0)
+		die("write error on recording: %s\n", strerror(errno));
+	clock_gettime(CLOCK_MONOTONIC, &rec0);
+}
+
+/* open a recording and read its header: the size it was recorded at */
+FILE *
+recordopen(char *file, int *col, int *row)
+{
+	FILE *f;
+	char magic[sizeof(RECMAGIC) - 1];
+	uint32_t size[2];
+
+	if (!(f = fopen(file, "r")))
+		die("open recording '%s' failed: %s\n", file, strerror(errno));
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, RECMAGIC, sizeof(magic)) ||
+	    fread(size, sizeof(size), 1, f) != 1)
+		die("not a recording of st\n");
+	*col = size[0];
+	*row = size[1];
+
+	return f;
+}
+
+static void
+recordwrite(uint32_t len, const char *s, size_t n)
+{
+	struct timespec now;
+	uint64_t us;
+	struct iovec iov[] = {
+		{ &us, sizeof(us) }, { &len, sizeof(len) }, { (char *)s, n },
+	};
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = 1E3 * TIMEDIFF(now, rec0);
+	if (writev(recfd, iov, LEN(iov)) != sizeof(us) + sizeof(len) + n) {
+		fprintf(stderr, "write error on recording, stopped: %s\n",
+				strerror(errno));
+		close(recfd);
+		recfd = -1;
+	}
+}
+
+static void
+replay(char *file, int out, int fast)
+{
+	FILE *f;
+	char buf[BUFSIZ];
+	struct timespec t0, t;
+	uint64_t us;
+	uint32_t len, size[2];
+	int col, row;
+
+	f = recordopen(file, &col, &row);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (fread(&us, sizeof(us), 1, f) == 1 &&
+	       fread(&len, sizeof(len), 1, f) == 1) {
+		if (len == RECRESIZE) {
+			/* st follows XTWINOPS 8, see csihandle() */
+			if (fread(size, sizeof(size), 1, f) != 1)
+				die("truncated recording\n");
+			len = snprintf(buf, sizeof(buf), "\033[8;%u;%ut",
+			               size[1], size[0]);
+		} else if (len > sizeof(buf) || fread(buf, 1, len, f) != len) {
+			die("truncated recording\n");
+		}
+		if (!fast) {
+			t.tv_sec = t0.tv_sec + us / 1000000;
+			t.tv_nsec = t0.tv_nsec + us % 1000000 * 1000;
+			if (t.tv_nsec >= 1000000000) {
+				t.tv_sec++;
+				t.tv_nsec -= 1000000000;
+			}
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			                       &t, NULL) == EINTR)
+				;
+		}
+		if (xwrite(out, buf, len) < 0)
+			_exit(1);
+	}
+
+	/*
+	 * When played in real time, keep showing the end until st is gone:
+	 * its end of the socket is closed then, however it exits.
+	 */
+	if (!fast) {
+		while (read(out, buf, sizeof(buf)) > 0)
+			;
+	}
+	_exit(0);
+}
+
+/*
+ * Play a recording as the output of the child, either at its original pace
+ * or as fast as the terminal reads it. Input to the child is discarded,
+ * see ttywriteraw().
+ */
+int
+ttyreplay(char *file, int fast)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		die("socketpair failed: %s\n", strerror(errno));
+
+	switch (pid = fork()) {
+	case -1:
+		die("fork failed: %s\n", strerror(errno));
+		break;
+	case 0:
+		close(sv[0]);
+		replay(file, sv[1], fast);
+		break;
+	default:
+		/*
+		 * No SIGCHLD handler: st ends on the end of file, after
+		 * everything written by the player has been read.
+		 */
+		close(sv[1]);
+		cmdfd = sv[0];
+		fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
+		/* the shells of other tabs must not hold the player up */
+		fcntl(cmdfd, F_SETFD, FD_CLOEXEC);
+		replaying = 1;
+		break;
+	}
+	return cmdfd;
+}
+
 size_t
 ttyread(void)
 {
-	static char buf[BUFSIZ];
-	static int buflen = 0;
 	int ret, written;
 
+	if (!rbuf)
+		rbuf = xmalloc(BUFSIZ);
+
 	/* append read bytes to unprocessed bytes */
-	ret = read(cmdfd, buf+buflen, LEN(buf)-buflen);
+	ret = read(cmdfd, rbuf+rlen, BUFSIZ-rlen);
 
 	switch (ret) {
-	case 0:
-		exit(0);
 	case -1:
-		die("couldn't read from shell: %s\n", strerror(errno));
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		/*
+		 * The shell is gone: it was waited for while other tabs were
+		 * open, or it is no child of a reattached st.
+		 */
+		if ((errno != EIO || !(attached || reaped)) && nsess == 1)
+			die("couldn't read from shell: %s\n", strerror(errno));
+		/* FALLTHROUGH */
+	case 0:
+		if (nsess == 1)
+			exit(0);
+		ttyend = 1;
+		return 0;
 	default:
-		buflen += ret;
-		written = twrite(buf, buflen, 0);
-		buflen -= written;
+		lattrace(LAT_READ);
+		if (recfd >= 0)
+			recordwrite(ret, rbuf + rlen, ret);
+		rlen += ret;
+		PROF(PROF_TWRITE, written = twrite(rbuf, rlen, 0));
+		rlen -= written;
 		/* keep any incomplete UTF-8 byte sequence for the next call */
-		if (buflen > 0)
-			memmove(buf, buf + written, buflen);
+		if (rlen > 0)
+			memmove(rbuf, rbuf + written, rlen);
 		return ret;
 	}
 }
 
+/* whether the tty of the current session was closed, if others are left */
+int
+ttyended(void)
+{
+	return ttyend;
+}
+
 void
 ttywrite(const char *s, size_t n, int may_echo)
 {
 	const char *next;
 
+	lattrace(LAT_WRITE);
+
 	if (may_echo && IS_SET(MODE_ECHO))
 		twrite(s, n, 1);
 
@@ -878,68 +1678,165 @@ ttywrite(const char *s, size_t n, int may_echo)
 	}
 }
 
+/*
+ * Bytes for the tty are queued and written without blocking, as much as
+ * the tty accepts at once. Whatever is left is written by ttyflush() from
+ * the main loop as soon as the tty is writable again, so that the output
+ * of the child keeps being read in between and large pastes can neither
+ * deadlock nor stall the event loop.
+ */
 void
 ttywriteraw(const char *s, size_t n)
 {
-	fd_set wfd, rfd;
 	ssize_t r;
-	size_t lim = 256;
 
-	/*
-	 * Remember that we are using a pty, which might be a modem line.
-	 * Writing too much will clog the line. That's why we are doing this
-	 * dance.
-	 * FIXME: Migrate the world to Plan 9.
-	 */
-	while (n > 0) {
-		FD_ZERO(&wfd);
-		FD_ZERO(&rfd);
-		FD_SET(cmdfd, &wfd);
-		FD_SET(cmdfd, &rfd);
+	/* the player of a recording takes no input, do not queue it up */
+	if (replaying)
+		return;
 
-		/* Check if we can write. */
-		if (pselect(cmdfd+1, &rfd, &wfd, NULL, NULL, NULL) < 0) {
+	/* nothing queued: try to hand the bytes over directly */
+	if (wlen == woff) {
+		wlen = woff = 0;
+		if ((r = write(cmdfd, s, n)) < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				die("write error on tty: %s\n", strerror(errno));
+			r = 0;
+		}
+		s += r;
+		n -= r;
+		if (n == 0)
+			return;
+	}
+
+	if (wlen + n > wsiz) {
+		if (woff) {
+			memmove(wbuf, wbuf + woff, wlen - woff);
+			wlen -= woff;
+			woff = 0;
+		}
+		if (wlen + n > wsiz) {
+			wsiz = MAX(wlen + n, 2 * wsiz);
+			wbuf = xrealloc(wbuf, wsiz);
+		}
+	}
+	memcpy(wbuf + wlen, s, n);
+	wlen += n;
+}
+
+size_t
+ttyflush(void)
+{
+	ssize_t r;
+
+	while (woff < wlen) {
+		if ((r = write(cmdfd, wbuf + woff, wlen - woff)) < 0) {
 			if (errno == EINTR)
 				continue;
-			die("select failed: %s\n", strerror(errno));
-		}
-		if (FD_ISSET(cmdfd, &wfd)) {
-			/*
-			 * Only write the bytes written by ttywrite() or the
-			 * default of 256. This seems to be a reasonable value
-			 * for a serial line. Bigger values might clog the I/O.
-			 */
-			if ((r = write(cmdfd, s, (n < lim)? n : lim)) < 0)
-				goto write_error;
-			if (r < n) {
-				/*
-				 * We weren't able to write out everything.
-				 * This means the buffer is getting full
-				 * again. Empty it.
-				 */
-				if (n < lim)
-					lim = ttyread();
-				n -= r;
-				s += r;
-			} else {
-				/* All bytes have been written. */
+			if (errno == EAGAIN)
 				break;
-			}
+			die("write error on tty: %s\n", strerror(errno));
 		}
-		if (FD_ISSET(cmdfd, &rfd))
-			lim = ttyread();
+		woff += r;
 	}
-	return;
 
-write_error:
-	die("write error on tty: %s\n", strerror(errno));
+	return wlen - woff;
+}
+
+/*
+ * Follow a key press through the stages of enum latency_stage. A stage
+ * only counts while it is the next one expected; a new key press restarts
+ * the trace, so keys without output leave no sample behind.
+ */
+void
+lattrace(int stage)
+{
+	int i;
+
+	if (stage != LAT_KEY && stage != lat.stage)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &lat.t[stage]);
+	if ((lat.stage = stage + 1) < LAT_LAST)
+		return;
+
+	for (i = LAT_WRITE; i < LAT_LAST; i++) {
+		lat.ms[i][lat.n % LATSAMPLES] =
+			TIMEDIFF(lat.t[i], lat.t[LAT_KEY]);
+	}
+	lat.n++;
+	lat.stage = 0;
+}
+
+static int
+latcmp(const void *a, const void *b)
+{
+	float x = *(const float *)a, y = *(const float *)b;
+
+	return (x > y) - (x < y);
+}
+
+void
+latdump(FILE *f)
+{
+	static const char *name[] = {
+		[LAT_WRITE] = "write", [LAT_READ] = "read",
+		[LAT_DRAW] = "draw", [LAT_FLUSH] = "flush",
+	};
+	float s[LATSAMPLES];
+	int i, n = MIN(lat.n, LATSAMPLES);
+
+	fprintf(f, "latency since key press in ms, last %d of %d traces:\n",
+			n, lat.n);
+	if (!n)
+		return;
+	for (i = LAT_WRITE; i < LAT_LAST; i++) {
+		memcpy(s, lat.ms[i], n * sizeof(*s));
+		qsort(s, n, sizeof(*s), latcmp);
+		fprintf(f, "%-6s p50 %8.3f  p99 %8.3f  max %8.3f\n", name[i],
+				s[(n - 1) / 2], s[(n - 1) * 99 / 100], s[n - 1]);
+	}
+}
+
+#ifdef PROFILE
+void
+profadd(int stage, struct timespec *t0)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	prof[stage].calls++;
+	prof[stage].ms += TIMEDIFF(now, (*t0));
+}
+
+void
+profdump(FILE *f)
+{
+	static const char *name[] = {
+		[PROF_TTYREAD] = "ttyread", [PROF_TWRITE] = "twrite",
+		[PROF_TPUTC] = "tputc", [PROF_CSIHANDLE] = "csihandle",
+		[PROF_SCROLL] = "scroll", [PROF_MAKESPECS] = "makespecs",
+		[PROF_DRAWSPECS] = "drawspecs", [PROF_XFLUSH] = "XFlush",
+	};
+	double frames = MAX(prof[PROF_XFLUSH].calls, 1);
+	int i;
+
+	fprintf(f, "%-10s %12s %12s %12s %12s\n", "stage", "calls",
+			"ms", "calls/frame", "us/frame");
+	for (i = 0; i < PROF_LAST; i++) {
+		fprintf(f, "%-10s %12lu %12.3f %12.1f %12.3f\n", name[i],
+				prof[i].calls, prof[i].ms,
+				prof[i].calls / frames, 1E3 * prof[i].ms / frames);
+	}
 }
+#endif
 
 void
 ttyresize(int tw, int th)
 {
 	struct winsize w;
 
+	if (replaying)
+		return;
+
 	w.ws_row = term.row;
 	w.ws_col = term.col;
 	w.ws_xpixel = tw;
@@ -956,15 +1853,13 @@ ttyhangup()
 }
 
 int
-tattrset(int attr)
+tblinking(void)
 {
-	int i, j;
+	int i;
 
-	for (i = 0; i < term.row-1; i++) {
-		for (j = 0; j < term.col-1; j++) {
-			if (term.line[i][j].mode & attr)
-				return 1;
-		}
+	for (i = 0; i < term.row; i++) {
+		if (LINEBLINK(term.line[i]))
+			return 1;
 	}
 
 	return 0;
@@ -983,17 +1878,26 @@ tsetdirt(int top, int bot)
 }
 
 void
-tsetdirtattr(int attr)
+tsetdirtblink(void)
 {
-	int i, j;
+	int i;
 
-	for (i = 0; i < term.row-1; i++) {
-		for (j = 0; j < term.col-1; j++) {
-			if (term.line[i][j].mode & attr) {
-				tsetdirt(i, i);
-				break;
-			}
-		}
+	for (i = 0; i < term.row; i++) {
+		if (LINEBLINK(term.line[i]))
+			term.dirty[i] = 1;
+	}
+}
+
+/* recount the blinking cells of line y after moving cells around in it */
+void
+tlineblink(int y)
+{
+	Line l = term.line[y];
+	int x;
+
+	for (LINEBLINK(l) = 0, x = 0; x < buffCols; x++) {
+		if (l[x].mode & ATTR_BLINK)
+			LINEBLINK(l)++;
 	}
 }
 
@@ -1001,6 +1905,69 @@ void
 tfulldirt(void)
 {
 	tsetdirt(0, term.row-1);
+	nblits = 0; /* nothing to move, all is drawn again */
+}
+
+/*
+ * Marks the lines of orig..term.bot dirty after scrolling them by n, up if
+ * positive. Where possible, the lines already on the window are moved
+ * there by draw() instead of being drawn again, and the dirty flags move
+ * along with their lines.
+ */
+void
+tscrolldirt(int orig, int n)
+{
+	int h = term.bot - orig + 1, k = abs(n), *last;
+
+	if (histMode || sel.ob.x != -1 || k >= h || nblits == LEN(blits)) {
+		tsetdirt(orig, term.bot);
+		return;
+	}
+
+	last = nblits ? blits[nblits-1] : NULL;
+	if (last && last[0] == orig && last[1] == term.bot &&
+	    (last[2] > 0) == (n > 0)) {
+		/* successive scrolls of a region make one move */
+		last[2] += n;
+		if (abs(last[2]) >= h)
+			nblits--;
+	} else {
+		blits[nblits][0] = orig;
+		blits[nblits][1] = term.bot;
+		blits[nblits++][2] = n;
+	}
+
+	if (n > 0) {
+		memmove(&term.dirty[orig], &term.dirty[orig+k],
+				(h - k) * sizeof(*term.dirty));
+		tsetdirt(term.bot-k+1, term.bot);
+	} else {
+		memmove(&term.dirty[orig+k], &term.dirty[orig],
+				(h - k) * sizeof(*term.dirty));
+		tsetdirt(orig, orig+k-1);
+	}
+}
+
+/*
+ * The first term.row lines of buf are repeated behind its end, so that
+ * the screen can be a window into it. Lines y1..y2 were moved on the
+ * screen, update the other copy.
+ */
+void
+tsyncbuf(int y1, int y2)
+{
+	int y, j;
+
+	if (term.line < buf || term.line >= buf + buffSize)
+		return;
+
+	for (y = y1; y <= y2; y++) {
+		j = term.line - buf + y;
+		if (j >= buffSize)
+			buf[j - buffSize] = term.line[y];
+		else if (j < term.row)
+			buf[j + buffSize] = term.line[y];
+	}
 }
 
 void
@@ -1044,6 +2011,17 @@ treset(void)
 	}
 }
 
+/* sigchld() reads pid and nsess, keep them from changing under it */
+static void
+tsigchld(int block)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(block ? SIG_BLOCK : SIG_UNBLOCK, &set, NULL);
+}
+
 void
 tnew(int col, int row)
 {
@@ -1052,6 +2030,196 @@ tnew(int col, int row)
 	treset();
 }
 
+/* make session i the current one, a new one of the same size if unused */
+void
+tswitch(int i)
+{
+	Session *s = &sess[cursess];
+	int col = term.col, row = term.row;
+
+	if (i == cursess)
+		return;
+	tsigchld(1);
+#define X(v) memcpy(&s->v, &v, sizeof(v));
+	SESSION(X)
+#undef X
+	s = &sess[cursess = i];
+	if (!s->used) {
+		*s = (Session){ .used = 1, .iofd = 1, .recfd = -1,
+		                .sel = { .mode = SEL_IDLE, .ob.x = -1 } };
+		nsess++;
+	}
+#define X(v) memcpy(&v, &s->v, sizeof(v));
+	SESSION(X)
+#undef X
+	if (!buf)
+		tnew(col, row);
+	tsigchld(0);
+}
+
+static void
+sessfree(Session *s)
+{
+	Line *alt = (s->term.mode & MODE_ALTSCREEN) ? s->term.line : s->term.alt;
+	int y;
+
+	if (s->cmdfd >= 0)
+		close(s->cmdfd);
+	/* copied text still reads from the history */
+	seltextkeep(s->buf, 0, buffSize);
+	for (y = 0; y < buffSize; y++) {
+		if (s->buf[y] != s->deferline)
+			linefree(s->buf[y]);
+	}
+	if (s->deferline)
+		linefree(s->deferline);
+	for (y = 0; y < s->ndefer; y++) {
+		while (s->defer[y].n > 0)
+			linefree(s->defer[y].line[--s->defer[y].n]);
+		free(s->defer[y].line);
+	}
+	free(s->defer);
+	for (y = 0; y < s->term.row; y++)
+		linefree(alt[y]);
+	free(s->buf);
+	free(s->term.altring);
+	free(s->term.dirty);
+	free(s->term.tabs);
+	free(s->mark);
+	free(s->strescseq.buf);
+	free(s->wbuf);
+	free(s->rbuf);
+}
+
+/* free session i, which is not the current one, and close its tty */
+void
+tsessfree(int i)
+{
+	sessfree(&sess[i]);
+	sess[i].used = 0;
+	tsigchld(1);
+	nsess--;
+	tsigchld(0);
+}
+
+/* the structures tsave() writes as they are only fit the same build */
+static const char buildid[64] = VERSION " " __DATE__ " " __TIME__;
+
+/*
+ * Write the current session to fd for tload() of another st: the
+ * structures as they are, then what they point to. Its tty is passed
+ * on separately.
+ */
+int
+tsave(int fd)
+{
+	int hdr[3] = { buffSize, sizeof(Glyph), sizeof(Session) };
+	Line *alt = IS_SET(MODE_ALTSCREEN) ? term.line : term.alt;
+	ssize_t r;
+	int i;
+
+	treflowrest();
+	r = xwrite(fd, buildid, sizeof(buildid));
+	r |= xwrite(fd, (char *)hdr, sizeof(hdr));
+#define X(v) r |= xwrite(fd, (char *)&v, sizeof(v));
+	SESSION(X)
+#undef X
+	for (i = 0; i < buffSize; i++)
+		r |= xwrite(fd, (char *)(buf[i] - 1),
+				(buffCols + 1) * sizeof(Glyph));
+	for (i = 0; i < term.row; i++)
+		r |= xwrite(fd, (char *)(alt[i] - 1),
+				(term.col + 1) * sizeof(Glyph));
+	r |= xwrite(fd, (char *)term.tabs, term.col * sizeof(*term.tabs));
+	r |= xwrite(fd, strescseq.buf, strescseq.len);
+	r |= xwrite(fd, wbuf + woff, wlen - woff);
+	r |= xwrite(fd, rbuf, rlen);
+
+	return r < 0 ? -1 : 0;
+}
+
+static void
+tread(int fd, void *p, size_t len)
+{
+	errno = 0;
+	if (xread(fd, p, len) < 0)
+		die("couldn't read the session: %s\n",
+		    errno ? strerror(errno) : "unexpected end of file");
+}
+
+static Line
+lineread(int fd, int col)
+{
+	Line l = xmalloc((col + 1) * sizeof(Glyph));
+
+	tread(fd, l, (col + 1) * sizeof(Glyph));
+	return l + 1;
+}
+
+/* replace the current session, which has no tty yet, by one from tsave() */
+void
+tload(int fd, int tty)
+{
+	Session *s = &sess[cursess];
+	char id[sizeof(buildid)];
+	int hdr[3], i;
+	Line *alt;
+
+	tread(fd, id, sizeof(id));
+	tread(fd, hdr, sizeof(hdr));
+	if (memcmp(id, buildid, sizeof(id)) || hdr[0] != buffSize ||
+	    hdr[1] != sizeof(Glyph) || hdr[2] != sizeof(Session))
+		die("the session is of another build of st\n");
+
+#define X(v) memcpy(&s->v, &v, sizeof(v));
+	SESSION(X)
+#undef X
+	s->cmdfd = -1;
+	sessfree(s);
+#define X(v) tread(fd, &v, sizeof(v));
+	SESSION(X)
+#undef X
+
+	buf = xmalloc((buffSize + term.row) * sizeof(Line));
+	for (i = 0; i < buffSize; i++)
+		buf[i] = lineread(fd, buffCols);
+	for (i = 0; i < term.row; i++)
+		buf[buffSize + i] = buf[i];
+	alt = term.altring = xmalloc(2 * term.row * sizeof(Line));
+	for (i = 0; i < term.row; i++)
+		alt[i] = lineread(fd, term.col);
+	term.line = &buf[insertOff];
+	term.alt = alt;
+	if (IS_SET(MODE_ALTSCREEN)) {
+		term.alt = term.line;
+		term.line = alt;
+	}
+	term.tabs = xmalloc(term.col * sizeof(*term.tabs));
+	tread(fd, term.tabs, term.col * sizeof(*term.tabs));
+	term.dirty = xmalloc(term.row * sizeof(*term.dirty));
+	mark = xmalloc(term.col * term.row * sizeof(*mark));
+	memset(mark, 0, term.col * term.row * sizeof(*mark));
+	strescseq.buf = strescseq.siz ? xmalloc(strescseq.siz) : NULL;
+	tread(fd, strescseq.buf, strescseq.len);
+	wlen -= woff;
+	woff = 0;
+	wsiz = wlen;
+	wbuf = wlen ? xmalloc(wlen) : NULL;
+	tread(fd, wbuf, wlen);
+	rbuf = xmalloc(BUFSIZ);
+	tread(fd, rbuf, rlen);
+
+	/* what stays behind: printer, recording, selection */
+	cmdfd = tty;
+	attached = 1;
+	iofd = 1;
+	term.mode &= ~MODE_PRINT;
+	recfd = -1;
+	sel = (Selection){ .mode = SEL_IDLE, .ob.x = -1 };
+	nblits = 0;
+	tfulldirt();
+}
+
 void
 tswapscreen(void)
 {
@@ -1063,23 +2231,64 @@ tswapscreen(void)
 	tfulldirt();
 }
 
+/*
+ * Scrolls orig..term.bot of the alternate screen by n, up if positive, by
+ * moving the screen along its ring instead of rotating the region: only
+ * the lines outside of the region and the n lines that scroll out move.
+ * The screen goes back to the middle of the ring when it reaches an end.
+ * Returns 0 if rotating the region is cheaper.
+ */
+int
+tslide(int orig, int n)
+{
+	int k = abs(n), h = term.bot - orig + 1;
+	int below = term.row - 1 - term.bot;
+	Line *w = term.line;
+
+	if (!IS_SET(MODE_ALTSCREEN) || !k || k > term.row / 2 ||
+	    k + orig + below >= h)
+		return 0;
+
+	if (n > 0 ? w + term.row + k > term.altring + 2 * term.row :
+	            w - k < term.altring) {
+		memmove(term.altring + term.row / 2, w,
+				term.row * sizeof(Line));
+		w = term.altring + term.row / 2;
+	}
+	if (n > 0) {
+		memmove(&w[term.bot+1+k], &w[term.bot+1], below * sizeof(Line));
+		memcpy(&w[term.bot+1], &w[orig], k * sizeof(Line));
+		memmove(&w[k], w, orig * sizeof(Line));
+	} else {
+		memmove(&w[-k], w, orig * sizeof(Line));
+		memcpy(&w[orig-k], &w[term.bot-k+1], k * sizeof(Line));
+		memmove(&w[term.bot+1-k], &w[term.bot+1], below * sizeof(Line));
+	}
+	term.line = w + n;
+
+	return 1;
+}
+
 void
 tscrolldown(int orig, int n)
 {
-	if (!orig && historyBufferScroll(-n)) return;
+	if (!orig && term.bot == term.row-1 && historyBufferScroll(-n)) return;
 	int i;
 	Line temp;
 
 	LIMIT(n, 0, term.bot-orig+1);
 
-	tsetdirt(orig, term.bot-n);
 	tclearregion(0, term.bot-n+1, term.col-1, term.bot);
+	tscrolldirt(orig, -n);
 
-	for (i = term.bot; i >= orig+n; i--) {
-		temp = term.line[i];
-		term.line[i] = term.line[i-n];
-		term.line[i-n] = temp;
+	if (!tslide(orig, -n)) {
+		for (i = term.bot; i >= orig+n; i--) {
+			temp = term.line[i];
+			term.line[i] = term.line[i-n];
+			term.line[i-n] = temp;
+		}
 	}
+	tsyncbuf(orig, term.bot);
 
 	selscroll(orig, n);
 }
@@ -1087,20 +2296,23 @@ tscrolldown(int orig, int n)
 void
 tscrollup(int orig, int n)
 {
-	if (!orig && historyBufferScroll(n)) return;
+	if (!orig && term.bot == term.row-1 && historyBufferScroll(n)) return;
 	int i;
 	Line temp;
 
 	LIMIT(n, 0, term.bot-orig+1);
 
 	tclearregion(0, orig, term.col-1, orig+n-1);
-	tsetdirt(orig+n, term.bot);
+	tscrolldirt(orig, n);
 
-	for (i = orig; i <= term.bot-n; i++) {
-		temp = term.line[i];
-		term.line[i] = term.line[i+n];
-		term.line[i+n] = temp;
+	if (!tslide(orig, n)) {
+		for (i = orig; i <= term.bot-n; i++) {
+			temp = term.line[i];
+			term.line[i] = term.line[i+n];
+			term.line[i+n] = temp;
+		}
 	}
+	tsyncbuf(orig, term.bot);
 
 	selscroll(orig, -n);
 }
@@ -1131,43 +2343,13 @@ tnewline(int first_col)
 	int y = term.c.y;
 
 	if (y == term.bot) {
-		tscrollup(term.top, 1);
+		PROF(PROF_SCROLL, tscrollup(term.top, 1));
 	} else {
 		y++;
 	}
 	tmoveto(first_col ? 0 : term.c.x, y);
 }
 
-void
-csiparse(void)
-{
-	char *p = csiescseq.buf, *np;
-	long int v;
-
-	csiescseq.narg = 0;
-	if (*p == '?') {
-		csiescseq.priv = 1;
-		p++;
-	}
-
-	csiescseq.buf[csiescseq.len] = '\0';
-	while (p < csiescseq.buf+csiescseq.len) {
-		np = NULL;
-		v = strtol(p, &np, 10);
-		if (np == p)
-			v = 0;
-		if (v == LONG_MAX || v == LONG_MIN)
-			v = -1;
-		csiescseq.arg[csiescseq.narg++] = v;
-		p = np;
-		if (*p != ';' || csiescseq.narg == ESC_ARG_SIZ)
-			break;
-		p++;
-	}
-	csiescseq.mode[0] = *p++;
-	csiescseq.mode[1] = (p < csiescseq.buf+csiescseq.len) ? *p : '\0';
-}
-
 /* for absolute user moves, when decom is set */
 void
 tmoveato(int x, int y)
@@ -1223,6 +2405,11 @@ tsetchar(Rune u, Glyph *attr, int x, int y)
 		term.line[y][x-1].mode &= ~ATTR_WIDE;
 	}
 
+	if (term.line[y][x].mode & ATTR_BLINK)
+		LINEBLINK(term.line[y])--;
+	if (attr->mode & ATTR_BLINK)
+		LINEBLINK(term.line[y])++;
+
 	term.dirty[y] = 1;
 	term.line[y][x] = *attr;
 	term.line[y][x].u = u;
@@ -1231,8 +2418,8 @@ tsetchar(Rune u, Glyph *attr, int x, int y)
 void
 tclearregion(int x1, int y1, int x2, int y2)
 {
-	int x, y, temp;
-	Glyph *gp;
+	int x, y, temp, sx1, sx2;
+	Line line;
 
 	if (x1 > x2)
 		temp = x1, x1 = x2, x2 = temp;
@@ -1244,17 +2431,36 @@ tclearregion(int x1, int y1, int x2, int y2)
 	LIMIT(y1, 0, term.row-1);
 	LIMIT(y2, 0, term.row-1);
 
+	/* rows are cleared by copying from a blank one in the current colors */
+	if (blankcols < buffCols || blank[0].fg != term.c.attr.fg ||
+	    blank[0].bg != term.c.attr.bg) {
+		if (blankcols < buffCols) {
+			blankcols = buffCols;
+			blank = xrealloc(blank, blankcols * sizeof(*blank));
+		}
+		for (x = 0; x < blankcols; x++) {
+			blank[x] = (Glyph){
+				.u = ' ',
+				.fg = term.c.attr.fg,
+				.bg = term.c.attr.bg
+			};
+		}
+	}
+
 	for (y = y1; y <= y2; y++) {
 		term.dirty[y] = 1;
-		for (x = x1; x <= x2; x++) {
-			gp = &term.line[y][x];
-			if (selected(x, y))
-				selclear();
-			gp->fg = term.c.attr.fg;
-			gp->bg = term.c.attr.bg;
-			gp->mode = 0;
-			gp->u = ' ';
+		if (selrow(y, &sx1, &sx2) && sx1 <= x2 && sx2 >= x1)
+			selclear();
+		line = term.line[y];
+		if (x1 == 0 && x2 == buffCols-1) {
+			LINEBLINK(line) = 0;
+		} else if (LINEBLINK(line)) {
+			for (x = x1; x <= x2; x++) {
+				if (line[x].mode & ATTR_BLINK)
+					LINEBLINK(line)--;
+			}
 		}
+		memcpy(&line[x1], &blank[x1], (x2 - x1 + 1) * sizeof(Glyph));
 	}
 }
 
@@ -1272,6 +2478,7 @@ tdeletechar(int n)
 	line = term.line[term.c.y];
 
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	tlineblink(term.c.y);
 	tclearregion(term.col-n, term.c.y, term.col-1, term.c.y);
 }
 
@@ -1289,6 +2496,7 @@ tinsertblank(int n)
 	line = term.line[term.c.y];
 
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	tlineblink(term.c.y);
 	tclearregion(src, term.c.y, dst - 1, term.c.y);
 }
 
@@ -1296,14 +2504,14 @@ void
 tinsertblankline(int n)
 {
 	if (BETWEEN(term.c.y, term.top, term.bot))
-		tscrolldown(term.c.y, n);
+		PROF(PROF_SCROLL, tscrolldown(term.c.y, n));
 }
 
 void
 tdeleteline(int n)
 {
 	if (BETWEEN(term.c.y, term.top, term.bot))
-		tscrollup(term.c.y, n);
+		PROF(PROF_SCROLL, tscrollup(term.c.y, n));
 }
 
 int32_t
@@ -1610,6 +2818,10 @@ csihandle(void)
 	char buf[40];
 	int len;
 
+	/* only DEC private sequences are known */
+	if (csiescseq.priv && csiescseq.priv != '?')
+		goto unknown;
+
 	switch (csiescseq.mode[0]) {
 	default:
 	unknown:
@@ -1656,8 +2868,7 @@ csihandle(void)
 	case 'b': /* REP -- if last char is printable print it <n> more times */
 		DEFAULT(csiescseq.arg[0], 1);
 		if (term.lastc)
-			while (csiescseq.arg[0]-- > 0)
-				tputc(term.lastc);
+			trepeat(term.lastc, csiescseq.arg[0]);
 		break;
 	case 'C': /* CUF -- Cursor <n> Forward */
 	case 'a': /* HPR -- Cursor <n> Forward */
@@ -1740,11 +2951,11 @@ csihandle(void)
 		break;
 	case 'S': /* SU -- Scroll <n> line up */
 		DEFAULT(csiescseq.arg[0], 1);
-		tscrollup(term.top, csiescseq.arg[0]);
+		PROF(PROF_SCROLL, tscrollup(term.top, csiescseq.arg[0]));
 		break;
 	case 'T': /* SD -- Scroll <n> line down */
 		DEFAULT(csiescseq.arg[0], 1);
-		tscrolldown(term.top, csiescseq.arg[0]);
+		PROF(PROF_SCROLL, tscrolldown(term.top, csiescseq.arg[0]));
 		break;
 	case 'L': /* IL -- Insert <n> blank lines */
 		DEFAULT(csiescseq.arg[0], 1);
@@ -1797,6 +3008,12 @@ csihandle(void)
 			tmoveato(0, 0);
 		}
 		break;
+	case 't': /* XTWINOPS -- Window manipulation */
+		/* only a recording played back resizes the window */
+		if (csiescseq.priv || !replaying || csiescseq.arg[0] != 8)
+			goto unknown;
+		xsetsize(csiescseq.arg[2], csiescseq.arg[1]);
+		break;
 	case 's': /* DECSC -- Save cursor position (ANSI.SYS) */
 		tcursor(CURSOR_SAVE);
 		break;
@@ -1819,27 +3036,34 @@ csihandle(void)
 void
 csidump(void)
 {
-	size_t i;
-	uint c;
+	int i;
 
 	fprintf(stderr, "ESC[");
-	for (i = 0; i < csiescseq.len; i++) {
-		c = csiescseq.buf[i] & 0xff;
-		if (isprint(c)) {
-			putc(c, stderr);
-		} else if (c == '\n') {
-			fprintf(stderr, "(\\n)");
-		} else if (c == '\r') {
-			fprintf(stderr, "(\\r)");
-		} else if (c == 0x1b) {
-			fprintf(stderr, "(\\e)");
-		} else {
-			fprintf(stderr, "(%02x)", c);
-		}
-	}
+	if (csiescseq.priv)
+		putc(csiescseq.priv, stderr);
+	for (i = 0; i < csiescseq.narg; i++)
+		fprintf(stderr, "%s%d", i ? ";" : "", csiescseq.arg[i]);
+	for (i = 0; i < 2 && csiescseq.mode[i]; i++)
+		putc(csiescseq.mode[i], stderr);
 	putc('\n', stderr);
 }
 
+/* a digit or ';', arguments are parsed as they arrive, extra ones dropped */
+void
+csiparam(uchar c)
+{
+	int *arg;
+
+	if (csiescseq.narg == ESC_ARG_SIZ)
+		return;
+	if (c == ';') {
+		csiescseq.narg++;
+	} else {
+		arg = &csiescseq.arg[csiescseq.narg];
+		*arg = MIN(*arg * 10 + (c - '0'), 65535);
+	}
+}
+
 void
 csireset(void)
 {
@@ -1852,7 +3076,6 @@ strhandle(void)
 	char *p = NULL, *dec;
 	int j, narg, par;
 
-	term.esc &= ~(ESC_STR_END|ESC_STR);
 	strparse();
 	par = (narg = strescseq.narg) ? atoi(strescseq.args[0]) : 0;
 
@@ -1869,7 +3092,7 @@ strhandle(void)
 			if (narg > 2 && allowwindowops) {
 				dec = base64dec(strescseq.args[2]);
 				if (dec) {
-					xsetsel(dec);
+					xsetsel(seltextstr(dec));
 					xclipcopy();
 				} else {
 					fprintf(stderr, "erresc: invalid base64\n");
@@ -2111,7 +3334,6 @@ tstrsequence(uchar c)
 	}
 	strreset();
 	strescseq.type = c;
-	term.esc |= ESC_STR;
 }
 
 void
@@ -2134,18 +3356,8 @@ tcontrolcode(uchar ascii)
 		tnewline(IS_SET(MODE_CRLF));
 		return;
 	case '\a':   /* BEL */
-		if (term.esc & ESC_STR_END) {
-			/* backwards compatibility to xterm */
-			strhandle();
-		} else {
-			xbell();
-		}
+		xbell();
 		break;
-	case '\033': /* ESC */
-		csireset();
-		term.esc &= ~(ESC_CSI|ESC_ALTCHARSET|ESC_TEST);
-		term.esc |= ESC_START;
-		return;
 	case '\016': /* SO (LS1 -- Locking shift 1) */
 	case '\017': /* SI (LS0 -- Locking shift 0) */
 		term.charset = 1 - (ascii - '\016');
@@ -2197,58 +3409,40 @@ tcontrolcode(uchar ascii)
 	case 0x9a:   /* DECID -- Identify Terminal */
 		ttywrite(vtiden, strlen(vtiden), 0);
 		break;
-	case 0x9b:   /* TODO: CSI */
-	case 0x9c:   /* TODO: ST */
-		break;
-	case 0x90:   /* DCS -- Device Control String */
-	case 0x9d:   /* OSC -- Operating System Command */
-	case 0x9e:   /* PM -- Privacy Message */
-	case 0x9f:   /* APC -- Application Program Command */
-		tstrsequence(ascii);
-		return;
 	}
-	/* only CAN, SUB, \a and C1 chars interrupt a sequence */
-	term.esc &= ~(ESC_STR_END|ESC_STR);
 }
 
-/*
- * returns 1 when the sequence is finished and it hasn't to read
- * more characters for this sequence, otherwise 0
- */
-int
+/* ESC final, preceded by the intermediate in csiescseq.mode[0] if any */
+void
 eschandle(uchar ascii)
 {
+	if (csiescseq.mode[0]) {
+		switch (csiescseq.mode[1] ? 0 : csiescseq.mode[0]) {
+		case '(': /* GZD4 -- set primary charset G0 */
+		case ')': /* G1D4 -- set secondary charset G1 */
+		case '*': /* G2D4 -- set tertiary charset G2 */
+		case '+': /* G3D4 -- set quaternary charset G3 */
+			term.icharset = csiescseq.mode[0] - '(';
+			tdeftran(ascii);
+			return;
+		case '#':
+			tdectest(ascii);
+			return;
+		case '%':
+			tdefutf8(ascii);
+			return;
+		}
+		goto unknown;
+	}
+
 	switch (ascii) {
-	case '[':
-		term.esc |= ESC_CSI;
-		return 0;
-	case '#':
-		term.esc |= ESC_TEST;
-		return 0;
-	case '%':
-		term.esc |= ESC_UTF8;
-		return 0;
-	case 'P': /* DCS -- Device Control String */
-	case '_': /* APC -- Application Program Command */
-	case '^': /* PM -- Privacy Message */
-	case ']': /* OSC -- Operating System Command */
-	case 'k': /* old title set compatibility */
-		tstrsequence(ascii);
-		return 0;
 	case 'n': /* LS2 -- Locking shift 2 */
 	case 'o': /* LS3 -- Locking shift 3 */
 		term.charset = 2 + (ascii - 'n');
 		break;
-	case '(': /* GZD4 -- set primary charset G0 */
-	case ')': /* G1D4 -- set secondary charset G1 */
-	case '*': /* G2D4 -- set tertiary charset G2 */
-	case '+': /* G3D4 -- set quaternary charset G3 */
-		term.icharset = ascii - '(';
-		term.esc |= ESC_ALTCHARSET;
-		return 0;
 	case 'D': /* IND -- Linefeed */
 		if (term.c.y == term.bot) {
-			tscrollup(term.top, 1);
+			PROF(PROF_SCROLL, tscrollup(term.top, 1));
 		} else {
 			tmoveto(term.c.x, term.c.y+1);
 		}
@@ -2261,7 +3455,7 @@ eschandle(uchar ascii)
 		break;
 	case 'M': /* RI -- Reverse index */
 		if (term.c.y == term.top) {
-			tscrolldown(term.top, 1);
+			PROF(PROF_SCROLL, tscrolldown(term.top, 1));
 		} else {
 			tmoveto(term.c.x, term.c.y-1);
 		}
@@ -2286,53 +3480,115 @@ eschandle(uchar ascii)
 	case '8': /* DECRC -- Restore Cursor */
 		tcursor(CURSOR_LOAD);
 		break;
-	case '\\': /* ST -- String Terminator */
-		if (term.esc & ESC_STR_END)
-			strhandle();
+	case '\\': /* ST -- String Terminator, without a string */
 		break;
 	default:
-		fprintf(stderr, "erresc: unknown sequence ESC 0x%02X '%c'\n",
-			(uchar) ascii, isprint(ascii)? ascii:'.');
+	unknown:
+		fprintf(stderr, "erresc: unknown sequence ESC %.2s0x%02X '%c'\n",
+			csiescseq.mode, (uchar) ascii, isprint(ascii)? ascii:'.');
 		break;
 	}
-	return 1;
 }
 
-void
-tputc(Rune u)
+uchar
+escclass(Rune u)
 {
-	char c[UTF_SIZ];
-	int control;
-	int width, len;
-	Glyph *gp;
-
-	control = ISCONTROL(u);
-	if (u < 127 || !IS_SET(MODE_UTF8)) {
-		c[0] = u;
-		width = len = 1;
-	} else {
-		len = utf8encode(u, c);
-		if (!control && (width = wcwidth(u)) == -1)
-			width = 1;
+	switch (u) {
+	case '\a':
+		return CC_BEL;
+	case '\030':
+	case '\032':
+		return CC_CAN;
+	case '\033':
+		return CC_ESC;
+	case ';':
+		return CC_SEP;
+	case ':':
+		return CC_COLON;
+	case '[':
+		return CC_CSI;
+	case 'P':
+	case ']':
+	case '^':
+	case '_':
+	case 'k': /* old title set compatibility */
+		return CC_STRSTART;
+	case '\\':
+		return CC_BSL;
+	case 0x7f:
+		return CC_DEL;
+	case 0x9b:
+		return CC_C1CSI;
+	case 0x90:
+	case 0x9d:
+	case 0x9e:
+	case 0x9f:
+		return CC_C1STR;
+	case 0x9c:
+		return CC_C1ST;
 	}
+	if (u < 0x20)
+		return CC_C0;
+	if (u < 0x30)
+		return CC_INTER;
+	if (u < 0x3a)
+		return CC_DIGIT;
+	if (u < 0x40)
+		return CC_PRIV;
+	if (u < 0x80)
+		return CC_FINAL;
+	return (u < 0xa0) ? CC_C1 : CC_PRINT;
+}
 
-	if (IS_SET(MODE_PRINT))
-		tprinter(c, len);
+/*
+ * Feeds u to the parser, c holds its encoding. Control codes are acted on
+ * as soon as they arrive, they can be embedded inside a sequence.
+ */
+void
+tparse(Rune u, char *c, int len)
+{
+	uchar t;
 
-	/*
-	 * STR sequence must be checked before anything else
-	 * because it uses all following characters until it
-	 * receives a ESC, a SUB, a ST or any other C1 control
-	 * character.
-	 */
-	if (term.esc & ESC_STR) {
-		if (u == '\a' || u == 030 || u == 032 || u == 033 ||
-		   ISCONTROLC1(u)) {
-			term.esc &= ~(ESC_START|ESC_STR);
-			term.esc |= ESC_STR_END;
-			goto check_control_code;
-		}
+	t = esctrans[term.esc][escclass(u)];
+	term.esc = t & 0xf;
 
+	switch (t >> 4) {
+	case EA_PRINT: /* only in the ground state, tputc() does it */
+	case EA_IGNORE:
+		break;
+	case EA_EXECUTE:
+		tcontrolcode(u);
+		break;
+	case EA_CLEAR:
+		csireset();
+		break;
+	case EA_COLLECT:
+		if (BETWEEN(u, 0x3c, 0x3f)) {
+			csiescseq.priv = u;
+		} else if (!csiescseq.mode[0]) {
+			csiescseq.mode[0] = u;
+		} else {
+			/* a second intermediate, none of these are known */
+			csiescseq.mode[1] = u;
+			if (term.esc == ESC_CSIINTER)
+				term.esc = ESC_CSIIGNORE;
+		}
+		break;
+	case EA_PARAM:
+		csiparam(u);
+		break;
+	case EA_ESCDISPATCH:
+		eschandle(u);
+		break;
+	case EA_CSIDISPATCH:
+		csiescseq.narg = MIN(csiescseq.narg + 1, ESC_ARG_SIZ);
+		csiescseq.mode[csiescseq.mode[0] != '\0'] = u;
+		PROF(PROF_CSIHANDLE, csihandle());
+		break;
+	case EA_STRSTART:
+		tstrsequence(u);
+		break;
+	case EA_STRPUT:
 		if (strescseq.len+len >= strescseq.siz) {
 			/*
 			 * Here is a bug in terminals. If the user never sends
@@ -2344,73 +3600,71 @@ tputc(Rune u)
 			 * In the case users ever get fixed, here is the code:
 			 */
 			/*
-			 * term.esc = 0;
+			 * term.esc = ESC_GROUND;
 			 * strhandle();
 			 */
 			if (strescseq.siz > (SIZE_MAX - UTF_SIZ) / 2)
-				return;
+				break;
 			strescseq.siz *= 2;
 			strescseq.buf = xrealloc(strescseq.buf, strescseq.siz);
 		}
 
 		memmove(&strescseq.buf[strescseq.len], c, len);
 		strescseq.len += len;
-		return;
+		break;
+	case EA_STRDISPATCH:
+		strhandle();
+		break;
+	}
+
+	/* control codes are not shown ever */
+	if (ISCONTROL(u) && term.esc == ESC_GROUND)
+		term.lastc = 0;
+}
+
+void
+tputc(Rune u)
+{
+	char c[UTF_SIZ];
+	int control;
+	int width, len;
+	Glyph *gp;
+
+	control = ISCONTROL(u);
+	if (u < 127 || !IS_SET(MODE_UTF8)) {
+		c[0] = u;
+		len = 1;
+	} else {
+		len = utf8encode(u, c);
 	}
 
-check_control_code:
+	if (IS_SET(MODE_PRINT))
+		tprinter(c, len);
+
 	/*
-	 * Actions of control codes must be performed as soon they arrive
-	 * because they can be embedded inside a control sequence, and
-	 * they must not cause conflicts with sequences.
+	 * Sequences and control codes go through the parser, printable
+	 * characters outside of sequences go straight to the screen.
 	 */
-	if (control) {
-		tcontrolcode(u);
-		/*
-		 * control codes are not shown ever
-		 */
-		if (!term.esc)
-			term.lastc = 0;
-		return;
-	} else if (term.esc & ESC_START) {
-		if (term.esc & ESC_CSI) {
-			csiescseq.buf[csiescseq.len++] = u;
-			if (BETWEEN(u, 0x40, 0x7E)
-					|| csiescseq.len >= \
-					sizeof(csiescseq.buf)-1) {
-				term.esc = 0;
-				csiparse();
-				csihandle();
-			}
-			return;
-		} else if (term.esc & ESC_UTF8) {
-			tdefutf8(u);
-		} else if (term.esc & ESC_ALTCHARSET) {
-			tdeftran(u);
-		} else if (term.esc & ESC_TEST) {
-			tdectest(u);
-		} else {
-			if (!eschandle(u))
-				return;
-			/* sequence already finished */
-		}
-		term.esc = 0;
-		/*
-		 * All characters which form part of a sequence are not
-		 * printed
-		 */
+	if (term.esc != ESC_GROUND || control) {
+		tparse(u, c, len);
 		return;
 	}
 
+	if (len == 1 || (width = wcwidth(u)) == -1)
+		width = 1;
+
 	gp = &term.line[term.c.y][term.c.x];
 	if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
-		gp->mode |= ATTR_WRAP;
+		/* behind a wide character the cursor is not on the last cell */
+		term.line[term.c.y][term.col-1].mode |= ATTR_WRAP;
 		tnewline(1);
 		gp = &term.line[term.c.y][term.c.x];
 	}
 
-	if (IS_SET(MODE_INSERT) && term.c.x+width < term.col)
+	if (IS_SET(MODE_INSERT) && term.c.x+width < term.col) {
 		memmove(gp+width, gp, (term.col - term.c.x - width) * sizeof(Glyph));
+		tlineblink(term.c.y);
+	}
 
 	if (term.c.x+width > term.col) {
 		tnewline(1);
@@ -2423,6 +3677,8 @@ check_control_code:
 	if (width == 2) {
 		gp->mode |= ATTR_WIDE;
 		if (term.c.x+1 < term.col) {
+			if (gp[1].mode & ATTR_BLINK)
+				LINEBLINK(term.line[term.c.y])--;
 			gp[1].u = '\0';
 			gp[1].mode = ATTR_WDUMMY;
 		}
@@ -2434,6 +3690,82 @@ check_control_code:
 	}
 }
 
+/* tputc() of u n times, a row at a time if u is a single cell wide */
+void
+trepeat(Rune u, int n)
+{
+	Line line;
+	int i, x, k, width;
+
+	width = (u < 127 || !IS_SET(MODE_UTF8)) ? 1 : wcwidth(u);
+	if ((width != 1 && width != -1) || IS_SET(MODE_INSERT) ||
+	    IS_SET(MODE_PRINT)) {
+		while (n-- > 0)
+			tputc(u);
+		return;
+	}
+
+	while (n > 0) {
+		if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
+			term.line[term.c.y][term.c.x].mode |= ATTR_WRAP;
+			tnewline(1);
+		}
+
+		/* the ends may split wide characters, the rest is copied */
+		x = term.c.x;
+		k = MIN(n, term.col - x);
+		line = term.line[term.c.y];
+		tsetchar(u, &term.c.attr, x, term.c.y);
+		if (k > 1)
+			tsetchar(u, &term.c.attr, x + k - 1, term.c.y);
+		for (i = x + 1; i < x + k - 1; i++) {
+			if (line[i].mode & ATTR_BLINK)
+				LINEBLINK(line)--;
+			if (line[x].mode & ATTR_BLINK)
+				LINEBLINK(line)++;
+			line[i] = line[x];
+		}
+		n -= k;
+
+		if (x + k < term.col) {
+			tmoveto(x + k, term.c.y);
+		} else {
+			tmoveto(term.col - 1, term.c.y);
+			term.c.state |= CURSOR_WRAPNEXT;
+			/* without wrapping, the rest lands on the last cell */
+			if (!IS_SET(MODE_WRAP))
+				break;
+		}
+	}
+}
+
+/*
+ * Fast path for SGR, which colored output is mostly made of: applies a
+ * complete ESC [ <args> m at the start of s without feeding it to the
+ * parser a character at a time. Returns its length, or 0 to leave s to
+ * the parser.
+ */
+int
+tsgr(const char *s, int len)
+{
+	int i;
+
+	if (len < 3 || s[1] != '[' || term.esc != ESC_GROUND ||
+	    IS_SET(MODE_PRINT))
+		return 0;
+
+	csireset();
+	for (i = 2; i < len && (BETWEEN(s[i], '0', '9') || s[i] == ';'); i++)
+		csiparam(s[i]);
+	if (i == len || s[i] != 'm')
+		return 0;
+
+	csiescseq.narg = MIN(csiescseq.narg + 1, ESC_ARG_SIZ);
+	csiescseq.mode[0] = 'm';
+	tsetattr(csiescseq.arg, csiescseq.narg);
+	return i + 1;
+}
+
 int
 twrite(const char *buf, int buflen, int show_ctrl)
 {
@@ -2442,6 +3774,9 @@ twrite(const char *buf, int buflen, int show_ctrl)
 	int n;
 
 	for (n = 0; n < buflen; n += charsize) {
+		if (buf[n] == '\033' && !show_ctrl &&
+		    (charsize = tsgr(buf + n, buflen - n)))
+			continue;
 		if (IS_SET(MODE_UTF8)) {
 			/* process a complete utf8 char */
 			charsize = utf8decode(buf + n, &u, buflen - n);
@@ -2461,17 +3796,354 @@ twrite(const char *buf, int buflen, int show_ctrl)
 				tputc('^');
 			}
 		}
-		tputc(u);
+		PROF(PROF_TPUTC, tputc(u));
 	}
 	return n;
 }
 
+/*
+ * Lines are allocated with a glyph in front holding their LINEBLINK()
+ * count, so that it moves along with the line. Added cells are blank.
+ */
+Line
+linealloc(Line l, int oldcol, int col)
+{
+	Glyph *g;
+	int x;
+
+	for (x = col; l && LINEBLINK(l) && x < oldcol; x++) {
+		if (l[x].mode & ATTR_BLINK)
+			LINEBLINK(l)--;
+	}
+	g = xrealloc(l ? l - 1 : NULL, (col + 1) * sizeof(Glyph));
+	if (!l)
+		g[0].u = oldcol = 0;
+	for (x = oldcol; x < col; x++)
+		g[x + 1] = (Glyph){ .u = ' ' };
+	return g + 1;
+}
+
+void
+linefree(Line l)
+{
+	free(l - 1);
+}
+
+/* a new line of col blank cells, in the colors of pad */
+static Line
+lineblank(int col, Glyph pad)
+{
+	Line l = linealloc(NULL, 0, col);
+	int x;
+
+	for (x = 0; x < col; x++)
+		l[x] = pad;
+	return l;
+}
+
+/*
+ * Rewrap the lines ol[0..no-1], oc columns wide, to col columns: the lines
+ * joined by ATTR_WRAP are cut again at the new width. The old lines are
+ * freed, the *pn new ones returned. The places p are looked up in the new
+ * lines; blanks are added up to those with pad set, the others go to the
+ * last line of theirs when they fall in its blank end.
+ */
+static Line *
+reflow(Line *ol, int no, int oc, int col, Glyph pad, int *pn,
+       ReflowPos *p, int np)
+{
+	Line *nl, l = NULL;
+	Glyph *g;
+	int n = 0, siz = MAX(no, 1), k, k0, i, j, x, len, end, off[3];
+
+	nl = xmalloc(siz * sizeof(*nl));
+	for (k = 0; k < no; k = k0) {
+		k0 = k + 1;
+		if (col == oc) {
+			/* nothing to rewrap, the lines are kept */
+			for (j = 0; j < np; j++) {
+				if (p[j].y == k)
+					p[j].ny = n, p[j].nx = p[j].x;
+			}
+			nl[n++] = ol[k];
+			continue;
+		}
+
+		/* the logical line is made of the lines k..k0-1 */
+		while (k0 < no && ol[k0-1][oc-1].mode & ATTR_WRAP)
+			k0++;
+		for (g = ol[k0-1] + oc; g > ol[k0-1] && g[-1].u == ' ' &&
+				!(g[-1].mode & ~ATTR_WRAP) &&
+				g[-1].fg == defaultfg &&
+				g[-1].bg == defaultbg; g--)
+			/* nothing */ ;
+		len = (k0 - k - 1) * oc + (g - ol[k0-1]);
+
+		end = MAX(len, 1);
+		for (j = 0; j < np; j++) {
+			off[j] = BETWEEN(p[j].y, k, k0 - 1) ?
+			         (p[j].y - k) * oc + p[j].x : -1;
+			if (p[j].pad)
+				end = MAX(end, off[j] + 1);
+		}
+
+		for (x = col, i = 0; i < end; i++) {
+			g = (i < len) ? &ol[k + i/oc][i%oc] : &pad;
+			/* a wide character is not split over two lines */
+			if (x == col || (x == col - 1 && col > 1 &&
+					g->mode & ATTR_WIDE)) {
+				if (i > 0)
+					l[col-1].mode |= ATTR_WRAP;
+				if (n == siz) {
+					siz *= 2;
+					nl = xrealloc(nl, siz * sizeof(*nl));
+				}
+				l = nl[n++] = lineblank(col, pad);
+				x = 0;
+			}
+			for (j = 0; j < np; j++) {
+				if (i == off[j])
+					p[j].ny = n - 1, p[j].nx = x;
+			}
+			/* nor is the blank left in front of one that was */
+			if (i % oc == oc - 1 && i + 1 < len && g->u == ' ' &&
+			    g->mode == ATTR_WRAP &&
+			    ol[k + i/oc + 1][0].mode & ATTR_WIDE)
+				continue;
+			l[x] = *g;
+			l[x].mode &= ~ATTR_WRAP;
+			if (l[x++].mode & ATTR_BLINK)
+				LINEBLINK(l)++;
+		}
+		for (j = 0; j < np; j++) {
+			if (off[j] >= end)
+				p[j].ny = n - 1, p[j].nx = 0;
+		}
+		for (i = k; i < k0; i++)
+			linefree(ol[i]);
+	}
+
+	*pn = n;
+	return nl;
+}
+
+/* free the n oldest reflows of defer */
+static void
+tdeferfree(int n)
+{
+	int i, k;
+
+	for (i = 0; i < n; i++) {
+		for (k = 0; k < defer[i].n; k++)
+			linefree(defer[i].line[k]);
+		free(defer[i].line);
+	}
+	if (!(ndefer -= n)) {
+		free(defer);
+		defer = NULL;
+	} else if (n > 0) {
+		memmove(defer, defer + n, ndefer * sizeof(*defer));
+	}
+}
+
+/*
+ * Keep only the newest deferh logical lines of defer: each one makes a line
+ * of the history at least, the older ones would not fit in it anymore.
+ */
+static void
+tdefertrim(void)
+{
+	Reflow *d;
+	int i, j, k, ends = 0;
+
+	for (i = ndefer - 1; i >= 0; i--) {
+		d = &defer[i];
+		for (k = d->n - 1; k >= 0; k--) {
+			if (d->line[k][d->col-1].mode & ATTR_WRAP ||
+			    ends++ < deferh)
+				continue;
+			for (j = 0; j <= k; j++)
+				linefree(d->line[j]);
+			d->n -= k + 1;
+			memmove(d->line, d->line + k + 1, d->n * sizeof(Line));
+			tdeferfree(i);
+			return;
+		}
+	}
+}
+
+/*
+ * Rewrap the lines treflow() left for later to the current width, into the
+ * oldest deferh lines of the history, which wait for them.
+ */
+void
+treflowrest(void)
+{
+	Line *nl;
+	int i, j = deferh, k, n, y;
+
+	if (!deferh)
+		return;
+
+	/* the newest lines go to the newest of those waiting */
+	for (i = ndefer - 1; i >= 0 && j > 0; i--) {
+		nl = reflow(defer[i].line, defer[i].n, defer[i].col,
+		            term.col, defer[i].pad, &n, NULL, 0);
+		defer[i].n = 0;
+		for (k = n - 1; k >= 0; k--) {
+			if (j == 0) {
+				linefree(nl[k]);
+				continue;
+			}
+			y = (insertOff + term.row + --j) % buffSize;
+			buf[y] = nl[k];
+			if (y < term.row)
+				buf[buffSize + y] = nl[k];
+		}
+		free(nl);
+	}
+	while (j > 0) {
+		y = (insertOff + term.row + --j) % buffSize;
+		buf[y] = lineblank(term.col, deferline[0]);
+		if (y < term.row)
+			buf[buffSize + y] = buf[y];
+	}
+	tdeferfree(ndefer);
+	linefree(deferline);
+	deferline = NULL;
+	deferh = 0;
+}
+
+/* the n oldest lines of the history become lines of the screen */
+void
+tdeferuse(int n)
+{
+	int j, y;
+
+	n = MIN(n, deferh);
+	for (j = 0; j < n; j++) {
+		y = (insertOff + term.row + j) % buffSize;
+		buf[y] = lineblank(term.col, deferline[0]);
+		if (y < term.row)
+			buf[buffSize + y] = buf[y];
+	}
+	if (n > 0 && !(deferh -= n)) {
+		tdeferfree(ndefer);
+		linefree(deferline);
+		deferline = NULL;
+	}
+}
+
+/*
+ * Rewrap the main screen and its history to col columns. The first line of
+ * the screen stays on top unless the cursor would fall off the bottom. alt
+ * tells that the main screen is not the one shown, its cursor is saved
+ * then.
+ *
+ * Only the lines from the logical one at the top of the screen on are
+ * rewrapped at once. The older ones are left in defer at their width and
+ * the oldest deferh lines of the history all share the blank deferline,
+ * until the history is browsed and treflowrest() rewraps them. A resize
+ * thus costs about a screen, however long the history.
+ */
+static void
+treflow(int col, int row, int alt)
+{
+	Glyph pad = { .u = ' ', .fg = term.c.attr.fg, .bg = term.c.attr.bg };
+	TCursor *cur = (alt || histOp) ? &c[1] : &term.c;
+	ReflowPos p[3];
+	Line *ol, *nl;
+	int const oc = term.col, h = buffSize - row;
+	int n, nh, k, k0 = 0, i, top, cy, cx, hv, wrapnext;
+
+	if (col == oc && row == term.row)
+		return;
+	/* the history being browsed is needed as a whole */
+	if (histMode)
+		treflowrest();
+
+	/* the old lines from the oldest one not waiting on */
+	nh = buffSize - deferh;
+	ol = xmalloc(nh * sizeof(*ol));
+	for (k = 0; k < nh; k++)
+		ol[k] = buf[(insertOff + term.row + deferh + k) % buffSize];
+
+	/* the top of the screen, the cursor and the top of the view */
+	p[0] = (ReflowPos){ .y = nh - term.row, .pad = 1 };
+	p[1] = (ReflowPos){ .y = nh - term.row + MIN(cur->y, term.row - 1),
+	                    .x = MIN(cur->x, oc - 1), .pad = 1 };
+	p[2] = (ReflowPos){ .y = (histOff - insertOff - term.row +
+	                          2 * buffSize) % buffSize };
+
+	if (col != oc && !histMode) {
+		for (k0 = p[0].y; k0 > 0 && ol[k0-1][oc-1].mode & ATTR_WRAP;
+				k0--)
+			/* nothing */ ;
+		if (k0 > 0) {
+			defer = xrealloc(defer, (ndefer + 1) * sizeof(*defer));
+			defer[ndefer] = (Reflow){ .n = k0, .col = oc,
+			                          .pad = pad };
+			defer[ndefer].line = xmalloc(k0 * sizeof(Line));
+			memcpy(defer[ndefer++].line, ol, k0 * sizeof(Line));
+		}
+		for (i = 0; i < LEN(p); i++)
+			p[i].y -= k0;
+	}
+	nl = reflow(ol + k0, nh - k0, oc, col, pad, &n, p, LEN(p));
+	free(ol);
+	top = p[0].ny;
+	cy = p[1].ny;
+	cx = p[1].nx;
+	hv = p[2].ny;
+
+	/* a cursor waiting to wrap only does so at the last column */
+	wrapnext = cur->state & CURSOR_WRAPNEXT;
+	if (wrapnext && cx < col - 1)
+		cx++, wrapnext = 0;
+	if (cy - top >= row)
+		top = cy - row + 1;
+
+	/* the history older than the new lines waits for defer */
+	if (deferline)
+		linefree(deferline);
+	deferh = ndefer ? MAX(h - top, 0) : 0;
+	deferline = deferh ? lineblank(col, pad) : NULL;
+	if (deferh)
+		tdefertrim();
+	else
+		tdeferfree(ndefer);
+
+	/* the screen goes first in buf, the history after it */
+	buf = xrealloc(buf, (buffSize + row) * sizeof(Line));
+	for (i = 0; i < buffSize; i++) {
+		k = (i < row) ? top + i : top - h + i - row;
+		if (BETWEEN(k, 0, n - 1))
+			buf[i] = nl[k];
+		else
+			buf[i] = (k < 0 && deferh) ? deferline :
+			         lineblank(col, pad);
+	}
+	for (k = 0; k < n; k++) {
+		if (!BETWEEN(k, top - h, top + row - 1))
+			linefree(nl[k]);
+	}
+	free(nl);
+
+	/* the history being browsed stays in view */
+	insertOff = 0;
+	histOff = histMode ? (MAX(hv, top - h) - top + buffSize) % buffSize : 0;
+	term.line = &buf[histOp ? histOff : insertOff];
+	cur->x = cx;
+	cur->y = cy - top;
+	cur->state = (cur->state & ~CURSOR_WRAPNEXT) | wrapnext;
+	selclear();
+}
+
 void
 tresize(int col, int row)
 {
-	int i;
-	int const colSet = col, alt = IS_SET(MODE_ALTSCREEN), ini = buf == NULL;
-	col = MAX(col, buffCols);
+	int i, k;
+	int const alt = IS_SET(MODE_ALTSCREEN), ini = buf == NULL;
 	row = MIN(row, buffSize);
 	int const minrow = MIN(row, term.row), mincol = MIN(col, buffCols);
 	int *bp;
@@ -2482,7 +4154,10 @@ tresize(int col, int row)
 		        "tresize: error resizing to %dx%d\n", col, row);
 		return;
 	}
+	if (!ini && col == term.col && row == term.row)
+		return;
 	if (alt) tswapscreen();
+	if (!ini) seltextkeep(buf, 0, buffSize);
 
 	/*
 	 * slide screen to keep cursor where we expect it -
@@ -2490,31 +4165,32 @@ tresize(int col, int row)
 	 * memmove because we're freeing the earlier lines
 	 */
 	for (i = 0; i <= term.c.y - row; i++) {
-		free(term.alt[i]);
+		linefree(term.alt[i]);
 	}
-	/* ensure that both src and dst are not NULL */
-	if (i > 0) {
-		memmove(term.alt, term.alt + i, row * sizeof(Line));
+	for (k = i + row; k < term.row; k++) {
+		linefree(term.alt[k]);
 	}
-	for (i += row; i < term.row; i++) {
-		free(term.alt[i]);
+	/* ensure that both src and dst are not NULL */
+	if (term.alt + i != term.altring) {
+		memmove(term.altring, term.alt + i,
+				MIN(row, term.row - i) * sizeof(Line));
 	}
 
 	/* resize to new height */
-	buf = xrealloc(buf, (buffSize + row) * sizeof(Line));
-	term.alt  = xrealloc(term.alt,  row * sizeof(Line));
+	term.altring = xrealloc(term.altring, 2 * row * sizeof(Line));
+	term.alt = term.altring;
 	term.dirty = xrealloc(term.dirty, row * sizeof(*term.dirty));
 	mark = xrealloc(mark, col * row * sizeof(*mark));
 	term.tabs = xrealloc(term.tabs, col * sizeof(*term.tabs));
 
 	/* resize each row to new width, zero-pad if needed */
 	for (i = 0; i < minrow; i++) {
-		term.alt[i]  = xrealloc(term.alt[i],  col * sizeof(Glyph));
+		term.alt[i] = linealloc(term.alt[i], buffCols, col);
 	}
 
 	/* allocate any new rows */
 	for (/* i = minrow */; i < row; i++) {
-		term.alt[i] = xmalloc(col * sizeof(Glyph));
+		term.alt[i] = linealloc(NULL, 0, col);
 	}
 	if (col > buffCols) {
 		bp = term.tabs + buffCols;
@@ -2525,16 +4201,19 @@ tresize(int col, int row)
 		for (bp += tabspaces; bp < term.tabs + col; bp += tabspaces)
 			*bp = 1;
 	}
-	Glyph g=(Glyph){.bg=term.c.attr.bg, .fg=term.c.attr.fg, .u=' ', .mode=0};
-	for (i = 0; i < buffSize; ++i) {
-		buf[i] = xrealloc(ini ? NULL : buf[i], col*sizeof(Glyph));
-		for (int j = ini ? 0 : buffCols; j < col; ++j) buf[i][j] = g;
+	if (ini) {
+		Glyph g = { .u = ' ', .fg = term.c.attr.fg,
+		            .bg = term.c.attr.bg };
+		buf = xmalloc((buffSize + row) * sizeof(Line));
+		for (i = 0; i < buffSize; ++i) buf[i] = lineblank(col, g);
+		term.line = buf;
+	} else {
+		treflow(col, row, alt);
 	}
 	for (i = 0; i < row; ++i) buf[buffSize + i] = buf[i];
-	term.line = &buf[*(histOp?&histOff:&insertOff) +=MAX(term.c.y-row+1,0)];
 	memset(mark, 0, col * row * sizeof(*mark));
 	/* update terminal size */
-	term.col = colSet;
+	term.col = col;
 	buffCols = col;
 	term.row = row;
 	if (alt) tswapscreen();
@@ -2542,19 +4221,28 @@ tresize(int col, int row)
 	tsetscroll(0, row-1);
 	/* make use of the LIMIT in tmoveto */
 	tmoveto(term.c.x, term.c.y);
-	/* Clearing both screens (it makes dirty all lines) */
+	/*
+	 * Clearing the new parts of the alternate screen (it makes dirty all
+	 * lines), those of the main one were filled by treflow().
+	 */
 	c = term.c;
-	for (i = 0; i < 2; i++) {
-		if (mincol < col && 0 < minrow) {
-			tclearregion(mincol, 0, col - 1, minrow - 1);
-		}
-		if (0 < col && minrow < row) {
-			tclearregion(0, minrow, col - 1, row - 1);
-		}
+	if (!alt) {
 		tswapscreen();
 		tcursor(CURSOR_LOAD);
 	}
+	if (mincol < col && 0 < minrow)
+		tclearregion(mincol, 0, col - 1, minrow - 1);
+	if (minrow < row)
+		tclearregion(0, minrow, col - 1, row - 1);
+	if (!alt)
+		tswapscreen();
 	term.c = c;
+
+	if (recfd >= 0) {
+		uint32_t size[2] = { col, row };
+
+		recordwrite(RECRESIZE, (char *)size, sizeof(size));
+	}
 }
 
 void
@@ -2579,6 +4267,26 @@ drawregion(int x1, int y1, int x2, int y2)
 	memset(&term.dirty[y1], 0, sizeof(*term.dirty) * (y2 - y1));
 }
 
+/* moves the region scrolls recorded by tscrolldirt() onto the window */
+void
+drawblits(void)
+{
+	int i, oy = term.ocy;
+
+	for (i = 0; i < nblits; i++) {
+		xscrollrows(blits[i][0], blits[i][1], blits[i][2]);
+		if (!BETWEEN(oy, blits[i][0], blits[i][1]))
+			continue;
+		oy -= blits[i][2];
+		if (!BETWEEN(oy, blits[i][0], blits[i][1]))
+			oy = -1;
+	}
+	/* the old cursor moved along, it is erased at its new place */
+	if (nblits && oy >= 0)
+		term.dirty[oy] = 1;
+	nblits = 0;
+}
+
 void
 draw(void)
 {
@@ -2595,7 +4303,12 @@ draw(void)
 	if (term.line[term.c.y][cx].mode & ATTR_WDUMMY)
 		cx--;
 
-	if (histMode) historyPreDraw();
+	if (histMode) {
+		if (nblits)
+			tfulldirt();
+		historyPreDraw();
+	}
+	drawblits();
 	drawregion(0, 0, term.col, term.row);
 	if (!histMode)
 	xdrawcursor(cx, term.c.y, term.line[term.c.y][cx],
@@ -18,6 +18,22 @@
 				(t1.tv_nsec-t2.tv_nsec)/1E6)
 #define MODBIT(x, set, bit)	((set) ? ((x) |= (bit)) : ((x) &= ~(bit)))
 
+/* account the time spent in call to a prof_stage, see config.mk */
+#ifdef PROFILE
+#define PROF(s, call)		do { \
+					struct timespec prof_t0; \
+					clock_gettime(CLOCK_MONOTONIC, &prof_t0); \
+					call; \
+					profadd(s, &prof_t0); \
+				} while (0)
+#else
+#define PROF(s, call)		call
+#endif
+
+#define RECMAGIC		"st recording 2\n" /* see ttyrecord() */
+#define RECRESIZE		UINT32_MAX /* length of a resize chunk */
+#define MAXSESSIONS		8 /* terminals per window, see tswitch() */
+
 #define TRUECOLOR(r,g,b)	(1 << 24 | (r) << 16 | (g) << 8 | (b))
 #define IS_TRUECOL(x)		(1 << 24 & (x))
 
@@ -37,6 +53,29 @@ enum glyph_attribute {
 	ATTR_BOLD_FAINT = ATTR_BOLD | ATTR_FAINT,
 };
 
+/* stages of an input latency trace, see lattrace() */
+enum latency_stage {
+	LAT_KEY,   /* key press */
+	LAT_WRITE, /* input written to the tty */
+	LAT_READ,  /* first output read afterwards */
+	LAT_DRAW,  /* draw of that output started */
+	LAT_FLUSH, /* frame flushed to the X server */
+	LAT_LAST
+};
+
+/* hot paths accounted by PROF() */
+enum prof_stage {
+	PROF_TTYREAD,
+	PROF_TWRITE,
+	PROF_TPUTC,
+	PROF_CSIHANDLE,
+	PROF_SCROLL,     /* tscrollup(), tscrolldown() and the history */
+	PROF_MAKESPECS,
+	PROF_DRAWSPECS,
+	PROF_XFLUSH,     /* once per frame */
+	PROF_LAST
+};
+
 enum selection_mode {
 	SEL_IDLE = 0,
 	SEL_EMPTY = 1,
@@ -70,6 +109,8 @@ typedef struct {
 
 typedef Glyph *Line;
 
+typedef struct SelText SelText;
+
 typedef union {
 	int i;
 	uint ui;
@@ -88,16 +129,33 @@ void printsel(const Arg *);
 void sendbreak(const Arg *);
 void toggleprinter(const Arg *);
 
-int tattrset(int);
+int tblinking(void);
 void tnew(int, int);
+int twrite(const char *, int, int);
 void tresize(int, int);
 void tmoveto(int x, int y);
-void tsetdirtattr(int);
+void tsetdirtblink(void);
+void tswitch(int);
+void tsessfree(int);
+int tsave(int);
+void tload(int, int);
 void ttyhangup(void);
 int ttynew(char *, char *, char *, char **);
+int ttyreplay(char *, int);
+FILE *recordopen(char *, int *, int *);
+void ttyrecord(char *);
 size_t ttyread(void);
+int ttyended(void);
 void ttyresize(int, int);
 void ttywrite(const char *, size_t, int);
+size_t ttyflush(void);
+
+void lattrace(int);
+void latdump(FILE *);
+#ifdef PROFILE
+void profadd(int, struct timespec *);
+void profdump(FILE *);
+#endif
 
 void resettitle(void);
 
@@ -105,11 +163,19 @@ void selclear(void);
 void selinit(void);
 void selstart(int, int, int);
 void selextend(int, int, int, int);
+int selrow(int, int *, int *);
 int selected(int, int);
 char *getsel(void);
+SelText *seltext(void);
+SelText *seltextstr(char *);
+SelText *seltextref(SelText *);
+void seltextfree(SelText *);
+size_t seltextread(SelText *, int *, size_t *, char *, size_t);
 
 size_t utf8encode(Rune, char *);
 
+ssize_t xwrite(int, const char *, size_t);
+ssize_t xread(int, char *, size_t);
 void *xmalloc(size_t);
 void *xrealloc(void *, size_t);
 char *xstrdup(char *);
@@ -120,6 +186,7 @@ extern char *scroll;
 extern char *stty_args;
 extern char *vtiden;
 extern wchar_t *worddelimiters;
+extern char const wDelS[], wDelL[];
 extern int allowaltscreen;
 extern int allowwindowops;
 extern char *termname;
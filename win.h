@@ -29,12 +29,14 @@ void xclipcopy(void);
 void xdrawcursor(int, int, Glyph, int, int, Glyph);
 void xdrawline(Line, int, int, int);
 void xfinishdraw(void);
+void xscrollrows(int, int, int);
 void xloadcols(void);
 int xsetcolorname(int, const char *);
 void xsettitle(char *);
 int xsetcursor(int);
 void xsetmode(int, unsigned int);
 void xsetpointermotion(int);
-void xsetsel(char *);
+void xsetsel(SelText *);
+void xsetsize(int, int);
 int xstartdraw(void);
 void xximspot(int, int);
@@ -1,20 +1,34 @@
 /* See LICENSE for license details. */
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <limits.h>
 #include <locale.h>
 #include <signal.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
+#if defined(__linux)
+ #include <sys/epoll.h>
+ #include <sys/signalfd.h>
+ #include <sys/timerfd.h>
+#endif
 #include <unistd.h>
 #include <libgen.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
+#include <X11/Xproto.h>
 #include <X11/cursorfont.h>
 #include <X11/keysym.h>
 #include <X11/Xft/Xft.h>
 #include <X11/XKBlib.h>
 #include <X11/Xresource.h>
+#ifdef XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
 
 char *argv0;
 #include "arg.h"
@@ -67,12 +81,15 @@ typedef struct {
 
 /* function definitions used in config.h */
 static void clipcopy(const Arg *);
+static void dumpstats(const Arg *);
 static void clippaste(const Arg *);
 static void numlock(const Arg *);
 static void selpaste(const Arg *);
 static void zoom(const Arg *);
 static void zoomabs(const Arg *);
 static void zoomreset(const Arg *);
+static void newtab(const Arg *);
+static void nexttab(const Arg *);
 static void ttysend(const Arg *);
 
 /* config.h for applying patches and the configuration. */
@@ -126,13 +143,69 @@ typedef struct {
 	int gm; /* geometry mask */
 } XWindow;
 
+/* outgoing INCR transfer of a selection */
 typedef struct {
-	Atom xtarget;
-	char *primary, *clipboard;
+	Window requestor;
+	Atom property, target;
+	SelText *text;
+	int y;       /* line and byte of the text sent next */
+	size_t off;
+	struct timespec last; /* when the requestor last took a chunk */
+} SelTransfer;
+
+typedef struct {
+	Atom xtarget, incratom;
+	SelText *primary, *clipboard;
+	SelTransfer *incr; /* running outgoing transfers */
+	int incrlen;
+	char *chunk;       /* buffer of chunksiz + 1 bytes */
+	size_t chunksiz;
+	int pasting;       /* incoming INCR paste: 1, 2 if bracketed */
 	struct timespec tclick1;
 	struct timespec tclick2;
 } XSelection;
 
+/* event sources of the main loop, see evwait() */
+enum evsource {
+	EvX,
+	EvTty,                          /* one per tab */
+	EvTimer = EvTty + MAXSESSIONS,
+	EvSignal,
+	EvAttach,                       /* st -r connecting, see detach() */
+	EvLast,
+};
+
+typedef struct {
+#if defined(__linux)
+	int ep;            /* epoll instance */
+	int timer;         /* timerfd for the next deadline */
+	int sig;           /* signalfd for SIGUSR1 */
+	struct timespec armed;
+	uint out;          /* sources also watched for writability */
+#else
+	int fd[EvLast];
+	uint out;
+	sigset_t mask;     /* signal mask while waiting */
+#endif
+} EventLoop;
+
+/*
+ * Tabs are the sessions of st.c, one of them shown in the window. The
+ * window state a terminal sets is kept with its tab, see tabuse().
+ */
+typedef struct {
+	int fd;            /* tty, -1 if the tab is not open */
+	int out;           /* bytes might be queued for the tty */
+	uint mode;         /* TABMODE bits of win.mode */
+	int cursor;
+	char *title;
+	char **colors;     /* colors set with OSC 4 by index, or NULL */
+} Tab;
+
+#define TABMODE (MODE_APPKEYPAD|MODE_MOUSE|MODE_MOUSESGR|MODE_REVERSE\
+                |MODE_KBDLOCK|MODE_HIDE|MODE_APPCURSOR|MODE_8BIT\
+                |MODE_FOCUS|MODE_BRCKTPASTE)
+
 /* Font structure */
 #define Font Font_
 typedef struct {
@@ -172,6 +245,7 @@ static void cresize(int, int);
 static void xresize(int, int);
 static void xhints(void);
 static int xloadcolor(int, const char *, Color *);
+static void xloadpalette(char **);
 static int xloadfont(Font *, FcPattern *);
 static void xloadfonts(char *, double);
 static void xunloadfont(Font *);
@@ -182,29 +256,58 @@ static int evcol(XEvent *);
 static int evrow(XEvent *);
 
 static void expose(XEvent *);
+static void gexpose(XEvent *);
 static void visibility(XEvent *);
 static void unmap(XEvent *);
 static void kpress(XEvent *);
 static void cmessage(XEvent *);
 static void resize(XEvent *);
+static void resizeflush(void);
 static void focus(XEvent *);
 static uint buttonmask(uint);
 static int mouseaction(XEvent *, uint);
 static void brelease(XEvent *);
 static void bpress(XEvent *);
 static void bmotion(XEvent *);
+static void motionflush(void);
 static void propnotify(XEvent *);
 static void selnotify(XEvent *);
+static void pasteend(void);
 static void selclear_(XEvent *);
 static void selrequest(XEvent *);
-static void setsel(char *, Time);
+static Atom selsend(XSelectionRequestEvent *, SelText *);
+static void selincr(XPropertyEvent *);
+static void selincrstop(SelTransfer *);
+static int selincrdrop(Window);
+static double selincrexpire(struct timespec *);
+static int xerror(Display *, XErrorEvent *);
+static void setsel(SelText *, Time);
 static void mousesel(XEvent *, int);
 static void mousereport(XEvent *);
 static char *kmap(KeySym, uint);
 static int match(uint, uint);
 
+static void evinit(void);
+static void evadd(int, int);
+static void evout(int, int, int);
+static void evdel(int, int);
+static uint evwait(double, struct timespec *);
+static double xrefreshperiod(void);
+static void tabuse(int);
+static void tabshow(int);
+static void tabclose(int);
+static void tabcolorsfree(int);
+static void tabflush(void);
+static int tabread(uint);
+static void detach(void);
+static int sendtabs(int);
+static void attach(int);
 static void run(void);
 static void usage(void);
+static int runaddr(struct sockaddr_un *, const char *, int);
+static void stdaemon(int *, char ***);
+static void stserve(int, int *, char ***);
+static void stclient(int, char *[]);
 
 static void (*handler[LASTEvent])(XEvent *) = {
 	[KeyPress] = kpress,
@@ -213,6 +316,7 @@ static void (*handler[LASTEvent])(XEvent *) = {
 	[VisibilityNotify] = visibility,
 	[UnmapNotify] = unmap,
 	[Expose] = expose,
+	[GraphicsExpose] = gexpose,
 	[FocusIn] = focus,
 	[FocusOut] = focus,
 	[MotionNotify] = bmotion,
@@ -236,6 +340,14 @@ static void (*handler[LASTEvent])(XEvent *) = {
 static DC dc;
 static XWindow xw;
 static XSelection xsel;
+static EventLoop evl;
+static Tab tabs[MAXSESSIONS];
+static int tab;    /* the tab shown */
+static int curtab; /* the tab of the current session */
+static int recolored; /* dc.col holds colors set by the tab shown */
+#if !defined(__linux)
+static volatile sig_atomic_t evsignal;
+#endif
 static TermWindow win;
 
 /* Font Ring Cache */
@@ -268,23 +380,37 @@ static char *opt_font  = NULL;
 static char *opt_io    = NULL;
 static char *opt_line  = NULL;
 static char *opt_name  = NULL;
+static char *opt_record = NULL;
+static char *opt_replay = NULL;
+static int opt_fast = 0;
+static int opt_detach = 0;
+static int opt_attach = 0;
 static char *opt_title = NULL;
 
 static int focused = 0;
 
+static int (*xerrorxlib)(Display *, XErrorEvent *);
+
 static int oldbutton = 3; /* button event on startup: 3 = release */
+static XEvent motion;     /* latest pointer motion, see motionflush() */
+static int motionpending;
+static int selx = -1, sely, selstate; /* cell last extended to */
+static int resizew, resizeh; /* latest window size, see resizeflush() */
+static int resizepending;
+static int servefd = -1;     /* connection of st -C, see stserve() */
+static int attachfd = -1;    /* detached st waiting for the window */
 
 void
 clipcopy(const Arg *dummy)
 {
 	Atom clipboard;
 
-	free(xsel.clipboard);
+	seltextfree(xsel.clipboard);
 	xsel.clipboard = NULL;
-	xsetsel(getsel());
+	xsetsel(seltext());
 
 	if (xsel.primary != NULL) {
-		xsel.clipboard = xstrdup(xsel.primary);
+		xsel.clipboard = seltextref(xsel.primary);
 		clipboard = XInternAtom(xw.dpy, "CLIPBOARD", 0);
 		XSetSelectionOwner(xw.dpy, clipboard, xw.win, CurrentTime);
 	}
@@ -379,7 +505,7 @@ mousesel(XEvent *e, int done)
 	}
 	selextend(evcol(e), evrow(e), seltype, done);
 	if (done)
-		setsel(getsel(), e->xbutton.time);
+		setsel(seltext(), e->xbutton.time);
 }
 
 void
@@ -482,6 +608,9 @@ bpress(XEvent *e)
 {
 	struct timespec now;
 
+	motionflush();
+	selx = -1;
+
 	if (IS_SET(MODE_MOUSE) && !(e->xbutton.state & forcemousemod)) {
 		mousereport(e);
 		return;
@@ -534,38 +663,54 @@ propnotify(XEvent *e)
 	Atom clipboard = XInternAtom(xw.dpy, "CLIPBOARD", 0);
 
 	xpev = &e->xproperty;
-	if (xpev->state == PropertyNewValue &&
+	if (xpev->state == PropertyDelete) {
+		selincr(xpev);
+	} else if (xpev->state == PropertyNewValue && xpev->window == xw.win &&
 			(xpev->atom == XA_PRIMARY ||
 			 xpev->atom == clipboard)) {
 		selnotify(e);
 	}
 }
 
+void
+pasteend(void)
+{
+	if (!xsel.pasting)
+		return;
+	MODBIT(xw.attrs.event_mask, 0, PropertyChangeMask);
+	XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask, &xw.attrs);
+	if (xsel.pasting == 2)
+		ttywrite("\033[201~", 6, 0);
+	xsel.pasting = 0;
+}
+
 void
 selnotify(XEvent *e)
 {
 	ulong nitems, ofs, rem;
 	int format;
 	uchar *data, *last, *repl;
-	Atom type, incratom, property = None;
-
-	incratom = XInternAtom(xw.dpy, "INCR", 0);
+	Atom type, property = None;
 
 	ofs = 0;
-	if (e->type == SelectionNotify)
+	if (e->type == SelectionNotify) {
+		/* a new transfer: an unfinished INCR paste was aborted */
+		pasteend();
 		property = e->xselection.property;
-	else if (e->type == PropertyNotify)
+	} else if (e->type == PropertyNotify) {
 		property = e->xproperty.atom;
+	}
 
 	if (property == None)
 		return;
 
 	do {
 		if (XGetWindowProperty(xw.dpy, xw.win, property, ofs,
-					BUFSIZ/4, False, AnyPropertyType,
+					xsel.chunksiz/4, False, AnyPropertyType,
 					&type, &format, &nitems, &rem,
 					&data)) {
 			fprintf(stderr, "Clipboard allocation failed\n");
+			pasteend();
 			return;
 		}
 
@@ -576,12 +721,12 @@ selnotify(XEvent *e)
 			 * data has been transferred. We won't need to receive
 			 * PropertyNotify events anymore.
 			 */
-			MODBIT(xw.attrs.event_mask, 0, PropertyChangeMask);
-			XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask,
-					&xw.attrs);
+			pasteend();
+			XFree(data);
+			break;
 		}
 
-		if (type == incratom) {
+		if (type == xsel.incratom) {
 			/*
 			 * Activate the PropertyNotify events so we receive
 			 * when the selection owner does send us the next
@@ -595,6 +740,14 @@ selnotify(XEvent *e)
 			 * Deleting the property is the transfer start signal.
 			 */
 			XDeleteProperty(xw.dpy, xw.win, (int)property);
+
+			/*
+			 * The chunks form a single paste: bracket it as a
+			 * whole, not each chunk on its own.
+			 */
+			xsel.pasting = IS_SET(MODE_BRCKTPASTE) ? 2 : 1;
+			if (xsel.pasting == 2)
+				ttywrite("\033[200~", 6, 0);
 			continue;
 		}
 
@@ -611,10 +764,10 @@ selnotify(XEvent *e)
 			*repl++ = '\r';
 		}
 
-		if (IS_SET(MODE_BRCKTPASTE) && ofs == 0)
+		if (!xsel.pasting && IS_SET(MODE_BRCKTPASTE) && ofs == 0)
 			ttywrite("\033[200~", 6, 0);
 		ttywrite((char *)data, nitems * format / 8, 1);
-		if (IS_SET(MODE_BRCKTPASTE) && rem == 0)
+		if (!xsel.pasting && IS_SET(MODE_BRCKTPASTE) && rem == 0)
 			ttywrite("\033[201~", 6, 0);
 		XFree(data);
 		/* number of 32-bit chunks returned */
@@ -631,6 +784,8 @@ selnotify(XEvent *e)
 void
 xclipcopy(void)
 {
+	if (!xw.dpy)
+		return;
 	clipcopy(NULL);
 }
 
@@ -646,7 +801,7 @@ selrequest(XEvent *e)
 	XSelectionRequestEvent *xsre;
 	XSelectionEvent xev;
 	Atom xa_targets, string, clipboard;
-	char *seltext;
+	SelText *seltext;
 
 	xsre = (XSelectionRequestEvent *) e;
 	xev.type = SelectionNotify;
@@ -684,13 +839,8 @@ selrequest(XEvent *e)
 				xsre->selection);
 			return;
 		}
-		if (seltext != NULL) {
-			XChangeProperty(xsre->display, xsre->requestor,
-					xsre->property, xsre->target,
-					8, PropModeReplace,
-					(uchar *)seltext, strlen(seltext));
-			xev.property = xsre->property;
-		}
+		if (seltext != NULL)
+			xev.property = selsend(xsre, seltext);
 	}
 
 	/* all done, send a notification to the listener */
@@ -698,14 +848,144 @@ selrequest(XEvent *e)
 		fprintf(stderr, "Error sending SelectionNotify event\n");
 }
 
+/*
+ * Store the text in the property of the requestor. Text larger than one
+ * chunk is announced with the INCR type instead and is then encoded chunk
+ * by chunk in selincr(), each time the requestor deletes the property
+ * again. Any number of transfers may run at once; none of them blocks.
+ */
+Atom
+selsend(XSelectionRequestEvent *xsre, SelText *text)
+{
+	SelTransfer *tr;
+	size_t len, off = 0;
+	long size = 0;
+	int i, y = 0;
+
+	/* one byte more than a chunk tells whether the text fits */
+	len = seltextread(text, &y, &off, xsel.chunk, xsel.chunksiz + 1);
+	if (len <= xsel.chunksiz) {
+		XChangeProperty(xsre->display, xsre->requestor, xsre->property,
+				xsre->target, 8, PropModeReplace,
+				(uchar *)xsel.chunk, len);
+		return xsre->property;
+	}
+
+	/* a requestor asking again into the same property starts over */
+	for (i = 0; i < xsel.incrlen; i++) {
+		if (xsel.incr[i].requestor == xsre->requestor &&
+				xsel.incr[i].property == xsre->property)
+			break;
+	}
+	if (i == xsel.incrlen)
+		xsel.incr = xrealloc(xsel.incr, ++xsel.incrlen * sizeof(*xsel.incr));
+	else
+		seltextfree(xsel.incr[i].text);
+	tr = &xsel.incr[i];
+	*tr = (SelTransfer){
+		.requestor = xsre->requestor, .property = xsre->property,
+		.target = xsre->target, .text = seltextref(text)
+	};
+	clock_gettime(CLOCK_MONOTONIC, &tr->last);
+
+	/* our own window already listens to property changes while pasting */
+	if (xsre->requestor != xw.win)
+		XSelectInput(xsre->display, xsre->requestor, PropertyChangeMask);
+	XChangeProperty(xsre->display, xsre->requestor, xsre->property,
+			xsel.incratom, 32, PropModeReplace, (uchar *)&size, 1);
+
+	return xsre->property;
+}
+
 void
-setsel(char *str, Time t)
+selincr(XPropertyEvent *xpev)
 {
-	if (!str)
+	SelTransfer *tr;
+	size_t len;
+	int i;
+
+	for (i = 0; i < xsel.incrlen; i++) {
+		tr = &xsel.incr[i];
+		if (xpev->window != tr->requestor || xpev->atom != tr->property)
+			continue;
+
+		len = seltextread(tr->text, &tr->y, &tr->off, xsel.chunk,
+				xsel.chunksiz);
+		XChangeProperty(xw.dpy, tr->requestor, tr->property, tr->target,
+				8, PropModeReplace, (uchar *)xsel.chunk, len);
+		clock_gettime(CLOCK_MONOTONIC, &tr->last);
+
+		/* the empty chunk marks the end of the transfer */
+		if (len == 0)
+			selincrstop(tr);
 		return;
+	}
+}
 
-	free(xsel.primary);
-	xsel.primary = str;
+void
+selincrstop(SelTransfer *tr)
+{
+	int i;
+
+	if (tr->requestor != xw.win) {
+		for (i = 0; i < xsel.incrlen; i++) {
+			if (&xsel.incr[i] != tr &&
+					xsel.incr[i].requestor == tr->requestor)
+				break;
+		}
+		if (i == xsel.incrlen)
+			XSelectInput(xw.dpy, tr->requestor, NoEventMask);
+	}
+	seltextfree(tr->text);
+	*tr = xsel.incr[--xsel.incrlen];
+}
+
+/* drop the transfers to a requestor window that does not exist anymore */
+int
+selincrdrop(Window w)
+{
+	int i, dropped = 0;
+
+	for (i = xsel.incrlen - 1; i >= 0; i--) {
+		if (xsel.incr[i].requestor == w) {
+			seltextfree(xsel.incr[i].text);
+			xsel.incr[i] = xsel.incr[--xsel.incrlen];
+			dropped = 1;
+		}
+	}
+
+	return dropped;
+}
+
+/*
+ * Drop the transfers whose requestor stopped taking chunks, and return
+ * the ms until the next one would expire, -1 if there is none.
+ */
+double
+selincrexpire(struct timespec *now)
+{
+	double left, next = -1;
+	int i;
+
+	for (i = xsel.incrlen - 1; i >= 0; i--) {
+		left = incrtimeout - TIMEDIFF((*now), xsel.incr[i].last);
+		if (left <= 0)
+			selincrstop(&xsel.incr[i]);
+		else if (next < 0 || left < next)
+			next = left;
+	}
+
+	return next;
+}
+
+void
+setsel(SelText *text, Time t)
+{
+	if (!text)
+		return;
+
+	seltextfree(xsel.primary);
+	xsel.primary = text;
 
 	XSetSelectionOwner(xw.dpy, XA_PRIMARY, xw.win, t);
 	if (XGetSelectionOwner(xw.dpy, XA_PRIMARY) != xw.win)
@@ -713,14 +993,20 @@ setsel(char *str, Time t)
 }
 
 void
-xsetsel(char *str)
+xsetsel(SelText *text)
 {
-	setsel(str, CurrentTime);
+	if (!xw.dpy) {
+		seltextfree(text);
+		return;
+	}
+	setsel(text, CurrentTime);
 }
 
 void
 brelease(XEvent *e)
 {
+	motionflush();
+
 	if (IS_SET(MODE_MOUSE) && !(e->xbutton.state & forcemousemod)) {
 		mousereport(e);
 		return;
@@ -734,11 +1020,31 @@ brelease(XEvent *e)
 void
 bmotion(XEvent *e)
 {
+	/* only the latest motion is applied, once per frame */
+	motion = *e;
+	motionpending = 1;
+}
+
+void
+motionflush(void)
+{
+	XEvent *e = &motion;
+	int x, y;
+
+	if (!motionpending)
+		return;
+	motionpending = 0;
+
 	if (IS_SET(MODE_MOUSE) && !(e->xbutton.state & forcemousemod)) {
 		mousereport(e);
 		return;
 	}
 
+	/* the selection does not change within a cell */
+	x = evcol(e), y = evrow(e);
+	if (x == selx && y == sely && e->xbutton.state == selstate)
+		return;
+	selx = x, sely = y, selstate = e->xbutton.state;
 	mousesel(e, 0);
 }
 
@@ -756,9 +1062,16 @@ cresize(int width, int height)
 	row = (win.h - 2 * borderpx) / win.ch;
 	col = MAX(1, col);
 	row = MAX(1, row);
+	/* a recording is played at the size it was made at */
+	if (opt_replay) {
+		col = cols;
+		row = rows;
+	}
 
-	tresize(col, row);
 	xresize(col, row);
+	/* the tabs in the background follow once shown, see tabshow() */
+	tabuse(tab);
+	tresize(col, row);
 	ttyresize(win.tw, win.th);
 }
 
@@ -817,42 +1130,77 @@ xloadalpha(void)
 	dc.col[defaultbg].pixel |= (unsigned char)(0xff * usedAlpha) << 24;
 }
 
+/* back to the configured colors for the current tab */
 void
 xloadcols(void)
 {
-	static int loaded;
-	Color *cp;
+	if (!xw.dpy)
+		return;
+
+	tabcolorsfree(curtab);
+	if (!dc.col || curtab == tab)
+		xloadpalette(NULL);
+}
+
+/* load the configured colors, and those of colors set over them */
+void
+xloadpalette(char **colors)
+{
+	Color ncolor;
+	int i;
 
-	if (!loaded) {
+	if (!dc.col) {
 		dc.collen = 1 + (defaultbg = MAX(LEN(colorname), 256));
 		dc.col = xmalloc((dc.collen) * sizeof(Color));
 	}
 
-	for (int i = 0; i+1 < dc.collen; ++i)
+	for (i = 0; i+1 < dc.collen; ++i)
 		if (!xloadcolor(i, NULL, &dc.col[i])) {
 			if (colorname[i])
 				die("could not allocate color '%s'\n", colorname[i]);
 			else
 				die("could not allocate color %d\n", i);
 		}
+	for (i = 0; colors && i < dc.collen; i++) {
+		if (colors[i] && xloadcolor(i, colors[i], &ncolor)) {
+			XftColorFree(xw.dpy, xw.vis, xw.cmap, &dc.col[i]);
+			dc.col[i] = ncolor;
+		}
+	}
+	recolored = colors != NULL;
 
 	xloadalpha();
-	loaded = 1;
 }
 
+/* each tab has its palette, only that of the tab shown is loaded */
 int
 xsetcolorname(int x, const char *name)
 {
 	Color ncolor;
+	char ***colors = &tabs[curtab].colors;
 
+	if (!xw.dpy)
+		return 0;
 	if (!BETWEEN(x, 0, dc.collen))
 		return 1;
 
 	if (!xloadcolor(x, name, &ncolor))
 		return 1;
 
+	if (!*colors) {
+		*colors = xmalloc(dc.collen * sizeof(**colors));
+		memset(*colors, 0, dc.collen * sizeof(**colors));
+	}
+	free((*colors)[x]);
+	(*colors)[x] = name ? xstrdup((char *)name) : NULL;
+
+	if (curtab != tab) {
+		XftColorFree(xw.dpy, xw.vis, xw.cmap, &ncolor);
+		return 0;
+	}
 	XftColorFree(xw.dpy, xw.vis, xw.cmap, &dc.col[x]);
 	dc.col[x] = ncolor;
+	recolored = 1;
 
 	return 0;
 }
@@ -1139,6 +1487,25 @@ xicdestroy(XIC xim, XPointer client, XPointer call)
 	return 1;
 }
 
+/*
+ * Requestors of a selection may vanish in the middle of a transfer. Errors
+ * caused by talking to their windows are ignored, everything else goes to
+ * the default handler, which exits.
+ */
+int
+xerror(Display *dpy, XErrorEvent *ee)
+{
+	if (ee->error_code == BadWindow && ee->resourceid != xw.win &&
+	    (ee->request_code == X_ChangeProperty ||
+	     ee->request_code == X_ChangeWindowAttributes ||
+	     ee->request_code == X_SendEvent)) {
+		selincrdrop(ee->resourceid);
+		return 0;
+	}
+
+	return xerrorxlib(dpy, ee);
+}
+
 void
 xinit(int cols, int rows)
 {
@@ -1149,6 +1516,7 @@ xinit(int cols, int rows)
 	XColor xmousefg, xmousebg;
 	XWindowAttributes attr;
 	XVisualInfo vis;
+	long maxreq;
 
 	xw.scr = XDefaultScreen(xw.dpy);
 
@@ -1255,6 +1623,14 @@ xinit(int cols, int rows)
 	xsel.xtarget = XInternAtom(xw.dpy, "UTF8_STRING", 0);
 	if (xsel.xtarget == None)
 		xsel.xtarget = XA_STRING;
+	xsel.incratom = XInternAtom(xw.dpy, "INCR", 0);
+
+	/* chunks of INCR transfers have to fit into a single request */
+	if (!(maxreq = XExtendedMaxRequestSize(xw.dpy)))
+		maxreq = XMaxRequestSize(xw.dpy);
+	xsel.chunksiz = MIN(selchunksize, maxreq * 4 - sz_xChangePropertyReq);
+	xsel.chunk = xmalloc(xsel.chunksiz + 1);
+	xerrorxlib = XSetErrorHandler(xerror);
 }
 
 int
@@ -1281,7 +1657,7 @@ xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len, int x
 		mode = g.mode;
 
 		/* Skip dummy wide-character spacing. */
-		if (mode == ATTR_WDUMMY)
+		if (mode & ATTR_WDUMMY)
 			continue;
 
 		/* Determine font for glyph if different from previous glyph. */
@@ -1532,8 +1908,8 @@ xdrawglyph(Glyph g, int x, int y)
 	int numspecs;
 	XftGlyphFontSpec spec;
 
-	numspecs = xmakeglyphfontspecs(&spec, &g, 1, x, y);
-	xdrawglyphfontspecs(&spec, g, numspecs, x, y);
+	PROF(PROF_MAKESPECS, numspecs = xmakeglyphfontspecs(&spec, &g, 1, x, y));
+	PROF(PROF_DRAWSPECS, xdrawglyphfontspecs(&spec, g, numspecs, x, y));
 }
 
 void
@@ -1635,6 +2011,13 @@ void
 xsettitle(char *p)
 {
 	XTextProperty prop;
+
+	if (p != tabs[curtab].title) {
+		free(tabs[curtab].title);
+		tabs[curtab].title = p ? xstrdup(p) : NULL;
+	}
+	if (curtab != tab || !xw.dpy)
+		return;
 	DEFAULT(p, opt_title);
 
 	Xutf8TextListToTextProperty(xw.dpy, &p, 1, XUTF8StringStyle,
@@ -1647,27 +2030,30 @@ xsettitle(char *p)
 int
 xstartdraw(void)
 {
-	return IS_SET(MODE_VISIBLE);
+	return IS_SET(MODE_VISIBLE) && curtab == tab;
 }
 
 void
 xdrawline(Line line, int x1, int y1, int x2)
 {
-	int i, x, ox, numspecs;
+	int i, x, ox, numspecs, issel, sx1, sx2;
 	Glyph base, new;
 	XftGlyphFontSpec *specs = xw.specbuf;
 
-	numspecs = xmakeglyphfontspecs(specs, &line[x1], x2 - x1, x1, y1);
+	issel = selrow(y1, &sx1, &sx2);
+	PROF(PROF_MAKESPECS, numspecs = xmakeglyphfontspecs(specs, &line[x1],
+				x2 - x1, x1, y1));
 	i = ox = 0;
 	for (x = x1; x < x2 && i < numspecs; x++) {
 		new = line[x];
 		historyOverlay(x, y1, &new);
-		if (new.mode == ATTR_WDUMMY)
+		if (new.mode & ATTR_WDUMMY)
 			continue;
-		if (selected(x, y1))
+		if (issel && BETWEEN(x, sx1, sx2))
 			new.mode ^= ATTR_REVERSE;
 		if (i > 0 && ATTRCMP(base, new)) {
-			xdrawglyphfontspecs(specs, base, i, ox, y1);
+			PROF(PROF_DRAWSPECS, xdrawglyphfontspecs(specs, base, i,
+						ox, y1));
 			specs += i;
 			numspecs -= i;
 			i = 0;
@@ -1679,7 +2065,7 @@ xdrawline(Line line, int x1, int y1, int x2)
 		i++;
 	}
 	if (i > 0)
-		xdrawglyphfontspecs(specs, base, i, ox, y1);
+		PROF(PROF_DRAWSPECS, xdrawglyphfontspecs(specs, base, i, ox, y1));
 }
 
 void
@@ -1690,6 +2076,21 @@ xfinishdraw(void)
 				defaultfg : defaultbg].pixel);
 }
 
+/* moves rows top+n..bot to top (or the other way for negative n) */
+void
+xscrollrows(int top, int bot, int n)
+{
+	int src = top + MAX(n, 0), dst = top - MIN(n, 0);
+
+	/* parts that could not be copied are reported by GraphicsExpose */
+	XSetGraphicsExposures(xw.dpy, dc.gc, True);
+	XCopyArea(xw.dpy, xw.buf, xw.buf, dc.gc,
+			borderpx, borderpx + src * win.ch,
+			win.tw, (bot - top + 1 - abs(n)) * win.ch,
+			borderpx, borderpx + dst * win.ch);
+	XSetGraphicsExposures(xw.dpy, dc.gc, False);
+}
+
 void
 xximspot(int x, int y)
 {
@@ -1705,15 +2106,28 @@ xximspot(int x, int y)
 void
 expose(XEvent *ev)
 {
-	redraw();
+	/* redrawn from run(), once for the whole burst of exposures */
+	if (ev->xexpose.count == 0)
+		tfulldirt();
+}
+
+void
+gexpose(XEvent *ev)
+{
+	if (ev->xgraphicsexpose.count == 0)
+		tfulldirt();
 }
 
 void
 visibility(XEvent *ev)
 {
 	XVisibilityEvent *e = &ev->xvisibility;
+	int visible = e->state != VisibilityFullyObscured;
 
-	MODBIT(win.mode, e->state != VisibilityFullyObscured, MODE_VISIBLE);
+	/* nothing was drawn while hidden */
+	if (visible && !IS_SET(MODE_VISIBLE))
+		tfulldirt();
+	MODBIT(win.mode, visible, MODE_VISIBLE);
 }
 
 void
@@ -1725,10 +2139,33 @@ unmap(XEvent *ev)
 void
 xsetpointermotion(int set)
 {
+	if (curtab != tab || !xw.dpy)
+		return;
 	MODBIT(xw.attrs.event_mask, set, PointerMotionMask);
 	XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask, &xw.attrs);
 }
 
+/* resize the window to follow a recording played back */
+void
+xsetsize(int col, int row)
+{
+	int cur = curtab;
+
+	if (!opt_replay || !xw.dpy || col < 1 || row < 1 ||
+	    (col == cols && row == rows))
+		return;
+	cols = col;
+	rows = row;
+	win.w = 2 * borderpx + col * win.cw;
+	win.h = 2 * borderpx + row * win.ch;
+	xhints();
+	XResizeWindow(xw.dpy, xw.win, win.w, win.h);
+	cresize(0, 0);
+	/* the player's tab is in the middle of twrite(), maybe not shown */
+	tabuse(cur);
+	tresize(col, row);
+}
+
 void
 xsetmode(int set, unsigned int flags)
 {
@@ -1760,6 +2197,8 @@ xseturgency(int add)
 void
 xbell(void)
 {
+	if (!xw.dpy)
+		return;
 	if (!(IS_SET(MODE_FOCUSED)))
 		xseturgency(1);
 	if (bellvolume)
@@ -1856,6 +2295,8 @@ kpress(XEvent *ev)
 
 	if (IS_SET(MODE_KBDLOCK))
 		return;
+	lattrace(LAT_KEY);
+	motionflush(); /* keep reports and keys in order */
 
 	if (xw.ime.xic)
 		len = XmbLookupString(xw.ime.xic, e, buf, sizeof buf, &ksym, &status);
@@ -1901,6 +2342,8 @@ kpress(XEvent *ev)
 void
 cmessage(XEvent *e)
 {
+	int i;
+
 	/*
 	 * See xembed specs
 	 *  http://standards.freedesktop.org/xembed-spec/xembed-spec-latest.html
@@ -1913,7 +2356,14 @@ cmessage(XEvent *e)
 			win.mode &= ~MODE_FOCUSED;
 		}
 	} else if (e->xclient.data.l[0] == xw.wmdeletewin) {
-		ttyhangup();
+		if (opt_detach)
+			detach();
+		for (i = 0; i < LEN(tabs); i++) {
+			if (tabs[i].fd < 0)
+				continue;
+			tabuse(i);
+			ttyhangup();
+		}
 		exit(0);
 	}
 }
@@ -1921,10 +2371,411 @@ cmessage(XEvent *e)
 void
 resize(XEvent *e)
 {
-	if (e->xconfigure.width == win.w && e->xconfigure.height == win.h)
+	/* only the latest size is applied, once per frame */
+	resizew = e->xconfigure.width;
+	resizeh = e->xconfigure.height;
+	resizepending = 1;
+}
+
+void
+resizeflush(void)
+{
+	if (!resizepending)
+		return;
+	resizepending = 0;
+
+	if (resizew != win.w || resizeh != win.h)
+		cresize(resizew, resizeh);
+}
+
+void
+dumpstats(const Arg *dummy)
+{
+	FILE *f = stderr;
+
+	if (statsfile && !(f = fopen(statsfile, "a"))) {
+		fprintf(stderr, "error opening %s: %s\n", statsfile,
+				strerror(errno));
+		return;
+	}
+	latdump(f);
+#ifdef PROFILE
+	profdump(f);
+#endif
+	if (f != stderr)
+		fclose(f);
+}
+
+#if defined(__linux)
+void
+evinit(void)
+{
+	sigset_t set;
+
+	if ((evl.ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		die("epoll_create1 failed: %s\n", strerror(errno));
+	evl.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (evl.timer < 0)
+		die("timerfd_create failed: %s\n", strerror(errno));
+	evadd(evl.timer, EvTimer);
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	if ((evl.sig = signalfd(-1, &set, SFD_NONBLOCK|SFD_CLOEXEC)) < 0)
+		die("signalfd failed: %s\n", strerror(errno));
+	evadd(evl.sig, EvSignal);
+}
+
+void
+evadd(int fd, int src)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = src };
+
+	if (epoll_ctl(evl.ep, EPOLL_CTL_ADD, fd, &ev) < 0)
+		die("epoll_ctl failed: %s\n", strerror(errno));
+}
+
+void
+evout(int fd, int src, int on)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = src };
+
+	if (!on == !(evl.out & 1 << src))
+		return;
+	MODBIT(evl.out, on, 1 << src);
+	if (on)
+		ev.events |= EPOLLOUT;
+	if (epoll_ctl(evl.ep, EPOLL_CTL_MOD, fd, &ev) < 0)
+		die("epoll_ctl failed: %s\n", strerror(errno));
+}
+
+void
+evdel(int fd, int src)
+{
+	MODBIT(evl.out, 0, 1 << src);
+	if (epoll_ctl(evl.ep, EPOLL_CTL_DEL, fd, NULL) < 0)
+		die("epoll_ctl failed: %s\n", strerror(errno));
+}
+
+/*
+ * Wait until a source has input or timeout ms after now have passed, and
+ * return the mask of sources with input. The deadline is kept in the
+ * timerfd, which is only rearmed when it changes.
+ */
+uint
+evwait(double timeout, struct timespec *now)
+{
+	struct epoll_event ev[EvLast];
+	struct signalfd_siginfo si;
+	struct itimerspec it;
+	uint64_t exp;
+	long long ns;
+	uint ready = 0;
+	int i, n;
+
+	memset(&it, 0, sizeof(it));
+	if (timeout > 0) {
+		ns = now->tv_nsec + (long long)(timeout * 1E6);
+		it.it_value.tv_sec = now->tv_sec + ns / 1000000000;
+		it.it_value.tv_nsec = ns % 1000000000;
+	}
+	if (timeout != 0 && (it.it_value.tv_sec != evl.armed.tv_sec ||
+	                     it.it_value.tv_nsec != evl.armed.tv_nsec)) {
+		if (timerfd_settime(evl.timer, TFD_TIMER_ABSTIME, &it, NULL) < 0)
+			die("timerfd_settime failed: %s\n", strerror(errno));
+		evl.armed = it.it_value;
+	}
+
+	while ((n = epoll_wait(evl.ep, ev, LEN(ev), timeout == 0 ? 0 : -1)) < 0) {
+		if (errno != EINTR)
+			die("epoll_wait failed: %s\n", strerror(errno));
+	}
+
+	for (i = 0; i < n; i++) {
+		/* nothing to read: the timer was rearmed and still runs */
+		if (ev[i].data.u32 == EvTimer &&
+		    read(evl.timer, &exp, sizeof(exp)) == sizeof(exp))
+			evl.armed = (struct timespec){0};
+		if (ev[i].data.u32 == EvSignal) {
+			while (read(evl.sig, &si, sizeof(si)) > 0)
+				;
+		}
+		/* writability only wakes us up */
+		if (ev[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+			ready |= 1 << ev[i].data.u32;
+	}
+
+	return ready;
+}
+#else
+static void
+evsigusr1(int unused)
+{
+	evsignal = 1;
+}
+
+void
+evinit(void)
+{
+	sigset_t set;
+	int i;
+
+	for (i = 0; i < EvLast; i++)
+		evl.fd[i] = -1;
+
+	/* SIGUSR1 is only let through while waiting, see evwait() */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &set, &evl.mask);
+	sigdelset(&evl.mask, SIGUSR1);
+	signal(SIGUSR1, evsigusr1);
+}
+
+void
+evadd(int fd, int src)
+{
+	evl.fd[src] = fd;
+}
+
+void
+evout(int fd, int src, int on)
+{
+	MODBIT(evl.out, on, 1 << src);
+}
+
+void
+evdel(int fd, int src)
+{
+	evl.fd[src] = -1;
+	MODBIT(evl.out, 0, 1 << src);
+}
+
+uint
+evwait(double timeout, struct timespec *now)
+{
+	fd_set rfd, wfd;
+	struct timespec tv;
+	uint ready = 0;
+	int i, maxfd = -1;
+
+	FD_ZERO(&rfd);
+	FD_ZERO(&wfd);
+	for (i = 0; i < EvLast; i++) {
+		if (evl.fd[i] < 0)
+			continue;
+		FD_SET(evl.fd[i], &rfd);
+		if (evl.out & 1 << i)
+			FD_SET(evl.fd[i], &wfd);
+		maxfd = MAX(maxfd, evl.fd[i]);
+	}
+
+	tv.tv_sec = timeout / 1E3;
+	tv.tv_nsec = 1E6 * (timeout - 1E3 * tv.tv_sec);
+	if (pselect(maxfd+1, &rfd, &wfd, NULL, timeout >= 0 ? &tv : NULL,
+	            &evl.mask) < 0) {
+		if (errno != EINTR)
+			die("select failed: %s\n", strerror(errno));
+		FD_ZERO(&rfd);
+	}
+	if (evsignal) {
+		evsignal = 0;
+		ready |= 1 << EvSignal;
+	}
+
+	for (i = 0; i < EvLast; i++) {
+		if (evl.fd[i] >= 0 && FD_ISSET(evl.fd[i], &rfd))
+			ready |= 1 << i;
+	}
+
+	return ready;
+}
+#endif
+
+/* refresh period in ms of the monitor showing the window, 0 if unknown */
+double
+xrefreshperiod(void)
+{
+	double period = 0;
+#ifdef XRANDR
+	XRRScreenResources *res;
+	XRRCrtcInfo *crtc;
+	XRRModeInfo *mode;
+	Window child;
+	int i, j, x, y, evbase, errbase;
+
+	if (!XRRQueryExtension(xw.dpy, &evbase, &errbase) ||
+	    !(res = XRRGetScreenResourcesCurrent(xw.dpy, xw.win)))
+		return 0;
+
+	/* prefer the crtc under the center of the window */
+	XTranslateCoordinates(xw.dpy, xw.win, DefaultRootWindow(xw.dpy),
+			win.w / 2, win.h / 2, &x, &y, &child);
+	for (i = 0; i < res->ncrtc; i++) {
+		if (!(crtc = XRRGetCrtcInfo(xw.dpy, res, res->crtcs[i])))
+			continue;
+		for (j = 0; j < res->nmode; j++) {
+			mode = &res->modes[j];
+			if (mode->id != crtc->mode || !mode->dotClock ||
+			    !mode->hTotal || !mode->vTotal)
+				continue;
+			if (period && (x < crtc->x || x >= crtc->x + crtc->width ||
+			    y < crtc->y || y >= crtc->y + crtc->height))
+				continue;
+			period = 1E3 * mode->hTotal * mode->vTotal /
+			         mode->dotClock;
+		}
+		XRRFreeCrtcInfo(crtc);
+	}
+	XRRFreeScreenResources(res);
+#endif
+	return period;
+}
+
+/* make the session of tab i current, along with its window state */
+void
+tabuse(int i)
+{
+	if (i == curtab)
 		return;
+	tabs[curtab].mode = win.mode & TABMODE;
+	tabs[curtab].cursor = win.cursor;
+	tswitch(i);
+	win.mode = (win.mode & ~TABMODE) | tabs[i].mode;
+	win.cursor = tabs[i].cursor;
+	curtab = i;
+}
 
-	cresize(e->xconfigure.width, e->xconfigure.height);
+void
+tabshow(int i)
+{
+	tabuse(i);
+	tab = i;
+	/* it kept its size while in the background */
+	if (win.tw > 0) {
+		tresize(win.tw / win.cw, win.th / win.ch);
+		ttyresize(win.tw, win.th);
+	}
+	xsettitle(tabs[i].title);
+	xsetpointermotion(IS_SET(MODE_MOUSEMANY));
+	if (xw.dpy && (recolored || tabs[i].colors))
+		xloadpalette(tabs[i].colors);
+	tfulldirt();
+}
+
+void
+tabcolorsfree(int i)
+{
+	int j;
+
+	for (j = 0; tabs[i].colors && j < dc.collen; j++)
+		free(tabs[i].colors[j]);
+	free(tabs[i].colors);
+	tabs[i].colors = NULL;
+}
+
+/* write what is queued for the ttys, as far as they take it */
+void
+tabflush(void)
+{
+	int i;
+
+	for (i = 0; i < LEN(tabs); i++) {
+		if (tabs[i].fd < 0 || (i != tab && !tabs[i].out))
+			continue;
+		tabuse(i);
+		tabs[i].out = ttyflush() > 0;
+		evout(tabs[i].fd, EvTty + i, tabs[i].out);
+	}
+	tabuse(tab);
+}
+
+/* parse the output of the ttys ready to be read, 1 if the shown one is */
+int
+tabread(uint ready)
+{
+	size_t n;
+	int i, j, shown = 0;
+
+	for (j = 0; j < LEN(tabs); j++) {
+		if (tabs[j].fd < 0 || !(ready & 1 << (EvTty + j)))
+			continue;
+		tabuse(j);
+		/*
+		 * nothing is drawn while hidden or in the background, parse
+		 * in large batches
+		 */
+		i = IS_SET(MODE_VISIBLE) && j == tab ? 1 : hiddenreads;
+		for (; i > 0; i--) {
+			PROF(PROF_TTYREAD, n = ttyread());
+			if (n == 0)
+				break;
+		}
+		/* replies to the terminal might have been queued */
+		tabs[j].out = 1;
+		shown |= j == tab;
+		if (ttyended())
+			tabclose(j);
+	}
+	tabuse(tab);
+
+	return shown;
+}
+
+/* close tab i, the current one, after its tty was closed */
+void
+tabclose(int i)
+{
+	int j;
+
+	if (i == tab && IS_SET(MODE_NORMAL))
+		normalMode();
+	evdel(tabs[i].fd, EvTty + i);
+	free(tabs[i].title);
+	tabcolorsfree(i);
+	tabs[i] = (Tab){ .fd = -1 };
+	for (j = 0; tabs[j].fd < 0; j++)
+		;
+	if (i == tab)
+		tabshow(j);
+	else
+		tabuse(j);
+	tsessfree(i);
+}
+
+void
+newtab(const Arg *dummy)
+{
+	int i;
+
+	/* normal mode stays in its tab */
+	if (IS_SET(MODE_NORMAL))
+		return;
+	for (i = 0; i < LEN(tabs) && tabs[i].fd >= 0; i++)
+		;
+	if (i == LEN(tabs))
+		return;
+
+	tabs[i] = (Tab){ .cursor = cursorshape };
+	tabuse(i);
+	tabs[i].fd = ttynew(NULL, shell, NULL, NULL);
+	ttyresize(win.tw, win.th);
+	evadd(tabs[i].fd, EvTty + i);
+	tabshow(i);
+}
+
+void
+nexttab(const Arg *arg)
+{
+	int i = tab;
+
+	if (IS_SET(MODE_NORMAL))
+		return;
+	do {
+		i = (i + arg->i + MAXSESSIONS) % MAXSESSIONS;
+	} while (tabs[i].fd < 0);
+	if (i != tab)
+		tabshow(i);
 }
 
 void
@@ -1932,10 +2783,11 @@ run(void)
 {
 	XEvent ev;
 	int w = win.w, h = win.h;
-	fd_set rfd;
-	int xfd = XConnectionNumber(xw.dpy), ttyfd, xev, drawing;
-	struct timespec seltv, *tv, now, lastblink, trigger;
-	double timeout;
+	int xfd = XConnectionNumber(xw.dpy), xev, drawing;
+	struct timespec now, lastblink, trigger, frame0;
+	double timeout, period = 0, incrwait;
+	uint ready;
+	int i, ttyin;
 
 	/* Waiting for window mapping */
 	do {
@@ -1953,40 +2805,76 @@ run(void)
 		}
 	} while (ev.type != MapNotify);
 
-	ttyfd = ttynew(opt_line, shell, opt_io, opt_cmd);
+	if (opt_attach) {
+		tabshow(tab);
+		/* the window is up, the detached st ends on this */
+		xwrite(attachfd, "", 1);
+		close(attachfd);
+	} else {
+		if (opt_replay)
+			tabs[0].fd = ttyreplay(opt_replay, opt_fast);
+		else
+			tabs[0].fd = ttynew(opt_line, shell, opt_io, opt_cmd);
+		for (i = 1; i < LEN(tabs); i++)
+			tabs[i].fd = -1;
+	}
 	cresize(w, h);
+	if (opt_record)
+		ttyrecord(opt_record);
+
+	evinit();
+	evadd(xfd, EvX);
+	for (i = 0; i < LEN(tabs); i++) {
+		if (tabs[i].fd >= 0)
+			evadd(tabs[i].fd, EvTty + i);
+	}
 
-	for (timeout = -1, drawing = 0, lastblink = (struct timespec){0};;) {
-		FD_ZERO(&rfd);
-		FD_SET(ttyfd, &rfd);
-		FD_SET(xfd, &rfd);
+	if (framesync && (period = xrefreshperiod()) <= 0)
+		period = refreshperiod;
 
-		if (XPending(xw.dpy))
-			timeout = 0;  /* existing events might not set xfd */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	frame0 = trigger = now;
+	for (timeout = -1, drawing = 0, lastblink = (struct timespec){0};;) {
+		/* pasted data still queued: wait for the ttys to take more */
+		tabflush();
 
-		seltv.tv_sec = timeout / 1E3;
-		seltv.tv_nsec = 1E6 * (timeout - 1E3 * seltv.tv_sec);
-		tv = timeout >= 0 ? &seltv : NULL;
+		/*
+		 * Existing events might not set xfd. The event loop below
+		 * and draw() both leave the output buffer flushed, so the
+		 * queue can be checked without another round trip.
+		 */
+		if (XEventsQueued(xw.dpy, QueuedAlready))
+			timeout = 0;
 
-		if (pselect(MAX(xfd, ttyfd)+1, &rfd, NULL, NULL, tv, NULL) < 0) {
-			if (errno == EINTR)
-				continue;
-			die("select failed: %s\n", strerror(errno));
-		}
+		ready = evwait(timeout, &now);
 		clock_gettime(CLOCK_MONOTONIC, &now);
 
-		if (FD_ISSET(ttyfd, &rfd))
-			ttyread();
+		ttyin = tabread(ready);
+		if (ready & 1 << EvSignal)
+			dumpstats(NULL);
 
 		xev = 0;
 		while (XPending(xw.dpy)) {
-			xev = 1;
 			XNextEvent(xw.dpy, &ev);
+			/* every blit of xscrollrows() reports one, no news */
+			if (ev.type == NoExpose)
+				continue;
+			xev = 1;
 			if (XFilterEvent(&ev, None))
 				continue;
 			if (handler[ev.type])
 				(handler[ev.type])(&ev);
 		}
+		incrwait = selincrexpire(&now);
+
+		if (!IS_SET(MODE_VISIBLE)) {
+			resizeflush();
+			motionflush();
+			/* no draws or blink timers until visible again */
+			timeout = incrwait;
+			drawing = 0;
+			continue;
+		}
 
 		/*
 		 * To reduce flicker and tearing, when new content or event
@@ -1999,33 +2887,45 @@ run(void)
 		 * maximum latency intervals during `cat huge.txt`, and perfect
 		 * sync with periodic updates from animations/key-repeats/etc.
 		 */
-		if (FD_ISSET(ttyfd, &rfd) || xev) {
+		if (ttyin || xev) {
 			if (!drawing) {
 				trigger = now;
 				drawing = 1;
 			}
-			timeout = (maxlatency - TIMEDIFF(now, trigger)) \
-			          / maxlatency * minlatency;
+			if (period > 0) {
+				/* draw at the refresh following the trigger */
+				timeout = period - TIMEDIFF(now, trigger) -
+				          fmod(TIMEDIFF(trigger, frame0), period);
+			} else {
+				timeout = (maxlatency - TIMEDIFF(now, trigger)) \
+				          / maxlatency * minlatency;
+			}
 			if (timeout > 0)
 				continue;  /* we have time, try to find idle */
 		}
 
 		/* idle detected or maxlatency exhausted -> draw */
 		timeout = -1;
-		if (blinktimeout && tattrset(ATTR_BLINK)) {
+		if (blinktimeout && tblinking()) {
 			timeout = blinktimeout - TIMEDIFF(now, lastblink);
 			if (timeout <= 0) {
 				if (-timeout > blinktimeout) /* start visible */
 					win.mode |= MODE_BLINK;
 				win.mode ^= MODE_BLINK;
-				tsetdirtattr(ATTR_BLINK);
+				tsetdirtblink();
 				lastblink = now;
 				timeout = blinktimeout;
 			}
 		}
+		if (incrwait > 0 && (timeout < 0 || incrwait < timeout))
+			timeout = incrwait;
 
+		resizeflush();
+		motionflush();
+		lattrace(LAT_DRAW);
 		draw();
-		XFlush(xw.dpy);
+		PROF(PROF_XFLUSH, XFlush(xw.dpy));
+		lattrace(LAT_FLUSH);
 		drawing = 0;
 	}
 }
@@ -2083,22 +2983,478 @@ config_init(void)
 		resource_load(db, p->name, p->type, p->dst);
 }
 
+/*
+ * The sockets of the daemon and of detached st are in a directory only
+ * the user can enter, created if create is set.
+ */
+int
+runaddr(struct sockaddr_un *addr, const char *name, int create)
+{
+	char dir[sizeof(addr->sun_path) - 32], *base;
+	struct stat st;
+
+	base = getenv("XDG_RUNTIME_DIR");
+	snprintf(dir, sizeof(dir), "%s/st-%d", base ? base : "/tmp",
+	         (int)getuid());
+	if (create && mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return -1;
+	if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) ||
+	    st.st_uid != getuid() || st.st_mode & 077)
+		return -1;
+
+	*addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+	snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s", dir, name);
+	return 0;
+}
+
+/*
+ * With -D, st stays around with fontconfig initialized and forks a
+ * process for the window of each st -C, which returns from here with
+ * the arguments of the client. The forks share the memory of the
+ * daemon until they write to it.
+ */
+void
+stdaemon(int *argc, char ***argv)
+{
+	struct sockaddr_un addr;
+	FcPattern *pattern, *match;
+	FcFontSet *set;
+	FcResult result;
+	int s, c;
+
+	if (runaddr(&addr, "daemon", 1) < 0)
+		die("no private directory for the socket: %s\n",
+		    strerror(errno));
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		die("socket failed: %s\n", strerror(errno));
+	/* only a socket nobody answers on is left over and replaced */
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+		die("a daemon already listens on %s\n", addr.sun_path);
+	close(s);
+
+	/*
+	 * The windows start with the configuration and the caches of
+	 * fontconfig loaded here. Matching the default font, and sorting
+	 * the fonts for its fallbacks, maps and decodes what they use.
+	 */
+	if (!FcInit())
+		die("could not init fontconfig.\n");
+	if ((pattern = FcNameParse((FcChar8 *)font))) {
+		FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+		FcDefaultSubstitute(pattern);
+		if ((match = FcFontMatch(NULL, pattern, &result)))
+			FcPatternDestroy(match);
+		if ((set = FcFontSort(NULL, pattern, 1, NULL, &result)))
+			FcFontSetDestroy(set);
+		FcPatternDestroy(pattern);
+	}
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		die("socket failed: %s\n", strerror(errno));
+	unlink(addr.sun_path);
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(s, 8) < 0)
+		die("bind %s failed: %s\n", addr.sun_path, strerror(errno));
+	signal(SIGCHLD, SIG_IGN); /* the windows are not waited for */
+
+	for (;;) {
+		if ((c = accept(s, NULL, NULL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("accept failed: %s\n", strerror(errno));
+		}
+		switch (fork()) {
+		case -1:
+			fprintf(stderr, "fork failed: %s\n", strerror(errno));
+			break;
+		case 0:
+			close(s);
+			signal(SIGCHLD, SIG_DFL);
+			stserve(c, argc, argv);
+			return;
+		}
+		close(c);
+	}
+}
+
+/* take over what stclient() sent on s */
+void
+stserve(int s, int *argc, char ***argv)
+{
+	extern char **environ;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	char *data = NULL, *p, *end, **args, **env;
+	size_t len = 0, siz = 0;
+	ssize_t r;
+	int i, n, fds[3];
+
+	for (;;) {
+		if (len == siz)
+			data = xrealloc(data, siz = siz ? 2 * siz : 4096);
+		iov = (struct iovec){ .iov_base = data + len,
+		                      .iov_len = siz - len };
+		msg = (struct msghdr){ .msg_iov = &iov, .msg_iovlen = 1,
+		                       .msg_control = ctl.buf,
+		                       .msg_controllen = sizeof(ctl.buf) };
+		if ((r = recvmsg(s, &msg, 0)) < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			die("recvmsg failed: %s\n", strerror(errno));
+		if (r == 0)
+			break;
+		cm = CMSG_FIRSTHDR(&msg);
+		if (cm && cm->cmsg_level == SOL_SOCKET &&
+		    cm->cmsg_type == SCM_RIGHTS &&
+		    cm->cmsg_len == CMSG_LEN(sizeof(fds))) {
+			memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+			for (i = 0; i < 3; i++) {
+				dup2(fds[i], i);
+				close(fds[i]);
+			}
+		}
+		len += r;
+	}
+
+	/* the directory, the number of arguments, them and the environment */
+	end = data + len;
+	if (len == 0 || end[-1] != '\0')
+		exit(1);
+	for (i = 0, p = data; p < end; p++)
+		i += *p == '\0';
+	env = xmalloc((i + 1) * sizeof(*env));
+	p = data + strlen(data) + 1;
+	if (chdir(data) < 0)
+		fprintf(stderr, "chdir %s failed: %s\n", data, strerror(errno));
+	if (p >= end || (n = atoi(p)) < 0)
+		exit(1);
+	args = xmalloc((n + 1) * sizeof(*args));
+	for (i = -1; i < n && p < end; i++, p += strlen(p) + 1) {
+		if (i >= 0)
+			args[i] = p;
+	}
+	if (i < n)
+		exit(1);
+	args[n] = NULL;
+	for (i = 0; p < end; i++, p += strlen(p) + 1)
+		env[i] = p;
+	env[i] = NULL;
+	environ = env;
+
+	/* the client waits until the window closes this */
+	fcntl(s, F_SETFD, FD_CLOEXEC);
+	servefd = s;
+	*argc = n;
+	*argv = args;
+}
+
+/*
+ * Have the daemon open the window with the arguments, the working
+ * directory, the environment and the standard streams of this process,
+ * and wait until it is closed. Returns if there is no daemon.
+ */
+void
+stclient(int argc, char *argv[])
+{
+	extern char **environ;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	char cwd[PATH_MAX], num[16], c;
+	int s, i, fds[3] = { 0, 1, 2 };
+
+	if (runaddr(&addr, "daemon", 0) < 0 ||
+	    (s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return;
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(s);
+		return;
+	}
+	if (!getcwd(cwd, sizeof(cwd)))
+		strcpy(cwd, "/");
+
+	/* the standard streams go along with the directory */
+	iov = (struct iovec){ .iov_base = cwd, .iov_len = strlen(cwd) + 1 };
+	msg = (struct msghdr){ .msg_iov = &iov, .msg_iovlen = 1,
+	                       .msg_control = ctl.buf,
+	                       .msg_controllen = sizeof(ctl.buf) };
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	if (sendmsg(s, &msg, 0) < 0)
+		die("sendmsg failed: %s\n", strerror(errno));
+
+	snprintf(num, sizeof(num), "%d", argc);
+	xwrite(s, num, strlen(num) + 1);
+	for (i = 0; i < argc; i++)
+		xwrite(s, argv[i], strlen(argv[i]) + 1);
+	for (i = 0; environ[i]; i++)
+		xwrite(s, environ[i], strlen(environ[i]) + 1);
+	shutdown(s, SHUT_WR);
+
+	while (read(s, &c, 1) < 0 && errno == EINTR)
+		/* nothing */ ;
+	exit(0);
+}
+
+/*
+ * With -d, closing the window leaves st running without a display, its
+ * tabs alive, until st -r takes them over, see sendtabs(). Returns if
+ * that is not possible.
+ */
+void
+detach(void)
+{
+	struct sockaddr_un addr;
+	struct timespec now;
+	char name[32];
+	uint ready;
+	int s, c;
+
+	snprintf(name, sizeof(name), "detached-%d", (int)getpid());
+	if (runaddr(&addr, name, 1) < 0 ||
+	    (s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		fprintf(stderr, "couldn't detach: %s\n", strerror(errno));
+		return;
+	}
+	unlink(addr.sun_path);
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(s, 1) < 0) {
+		fprintf(stderr, "couldn't detach: %s\n", strerror(errno));
+		close(s);
+		return;
+	}
+	fcntl(s, F_SETFD, FD_CLOEXEC);
+
+	if (IS_SET(MODE_NORMAL))
+		normalMode();
+	evdel(XConnectionNumber(xw.dpy), EvX);
+	XCloseDisplay(xw.dpy);
+	xw.dpy = NULL;
+	win.mode &= ~(MODE_VISIBLE|MODE_FOCUSED);
+	/* st -C returns, and st outlives the terminal it was started from */
+	if (servefd >= 0)
+		close(servefd);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	evadd(s, EvAttach);
+
+	for (;;) {
+		tabflush();
+		ready = evwait(-1, &now);
+		tabread(ready);
+		if (!(ready & 1 << EvAttach) || (c = accept(s, NULL, NULL)) < 0)
+			continue;
+		if (sendtabs(c) == 0) {
+			unlink(addr.sun_path);
+			exit(0);
+		}
+		close(c);
+	}
+}
+
+/*
+ * Pass the tabs on to the st -r connected on c: their ttys, then the
+ * window state and the session of each, see tsave(). 0 once it has
+ * taken them.
+ */
+int
+sendtabs(int c)
+{
+	union {
+		char buf[CMSG_SPACE(MAXSESSIONS * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct timeval tv = { .tv_sec = 10 };
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	int hdr[4] = { 0, 0, win.tw / win.cw, win.th / win.ch };
+	int fds[MAXSESSIONS], ws[3], i, r = 0;
+	size_t len;
+	char ack;
+
+	/* an st -r that got stuck holds up the ttys only for so long */
+	setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	/* the number of tabs, the one shown and their size */
+	for (i = 0; i < LEN(tabs); i++) {
+		if (tabs[i].fd < 0)
+			continue;
+		if (i == tab)
+			hdr[1] = hdr[0];
+		fds[hdr[0]++] = tabs[i].fd;
+	}
+	len = hdr[0] * sizeof(int);
+	iov = (struct iovec){ .iov_base = hdr, .iov_len = sizeof(hdr) };
+	msg = (struct msghdr){ .msg_iov = &iov, .msg_iovlen = 1,
+	                       .msg_control = ctl.buf,
+	                       .msg_controllen = CMSG_SPACE(len) };
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(len);
+	memcpy(CMSG_DATA(cm), fds, len);
+	if (sendmsg(c, &msg, 0) < 0)
+		return -1;
+
+	for (i = 0; i < LEN(tabs) && r == 0; i++) {
+		if (tabs[i].fd < 0)
+			continue;
+		tabuse(i);
+		ws[0] = win.mode & TABMODE;
+		ws[1] = win.cursor;
+		ws[2] = tabs[i].title ? strlen(tabs[i].title) : -1;
+		if (xwrite(c, (char *)ws, sizeof(ws)) < 0 ||
+		    xwrite(c, tabs[i].title, MAX(ws[2], 0)) < 0 ||
+		    tsave(c) < 0)
+			r = -1;
+	}
+	tabuse(tab);
+
+	return (r < 0 || xread(c, &ack, 1) < 0) ? -1 : 0;
+}
+
+/*
+ * With -r, take over the tabs of the detached st with that pid, or of the
+ * only one if 0, instead of a new shell.
+ */
+void
+attach(int which)
+{
+	union {
+		char buf[CMSG_SPACE(MAXSESSIONS * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	struct dirent *e;
+	DIR *d;
+	int hdr[4], fds[MAXSESSIONS], ws[3], i, p, n = 0, s;
+	char name[32], *title;
+
+	if (!which) {
+		if (runaddr(&addr, "", 0) < 0 ||
+		    !(d = opendir(addr.sun_path)))
+			die("no detached st\n");
+		while ((e = readdir(d))) {
+			if (strncmp(e->d_name, "detached-", 9))
+				continue;
+			/* left behind by a detached st that ended */
+			p = atoi(e->d_name + 9);
+			if (kill(p, 0) < 0 && errno == ESRCH) {
+				runaddr(&addr, e->d_name, 0);
+				unlink(addr.sun_path);
+				continue;
+			}
+			if (n++ == 1)
+				fprintf(stderr, "detached st: %d", which);
+			if (n > 1)
+				fprintf(stderr, " %d", p);
+			else
+				which = p;
+		}
+		closedir(d);
+		if (n > 1)
+			die("\nchoose one with st -r pid\n");
+		if (!which)
+			die("no detached st\n");
+	}
+
+	snprintf(name, sizeof(name), "detached-%d", which);
+	if (runaddr(&addr, name, 0) < 0)
+		die("no detached st\n");
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		die("socket failed: %s\n", strerror(errno));
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		die("couldn't attach to %s: %s\n", addr.sun_path,
+		    strerror(errno));
+
+	iov = (struct iovec){ .iov_base = hdr, .iov_len = sizeof(hdr) };
+	msg = (struct msghdr){ .msg_iov = &iov, .msg_iovlen = 1,
+	                       .msg_control = ctl.buf,
+	                       .msg_controllen = sizeof(ctl.buf) };
+	if (recvmsg(s, &msg, MSG_WAITALL) != sizeof(hdr) ||
+	    !BETWEEN(hdr[0], 1, MAXSESSIONS) || !BETWEEN(hdr[1], 0, hdr[0]-1) ||
+	    !(cm = CMSG_FIRSTHDR(&msg)) || cm->cmsg_type != SCM_RIGHTS ||
+	    cm->cmsg_len != CMSG_LEN(hdr[0] * sizeof(int)))
+		die("couldn't attach to %s\n", addr.sun_path);
+	memcpy(fds, CMSG_DATA(cm), hdr[0] * sizeof(int));
+
+	for (i = 0; i < hdr[0]; i++) {
+		if (xread(s, (char *)ws, sizeof(ws)) < 0)
+			die("couldn't attach to %s\n", addr.sun_path);
+		title = NULL;
+		if (ws[2] >= 0) {
+			title = xmalloc(ws[2] + 1);
+			if (xread(s, title, ws[2]) < 0)
+				die("couldn't attach to %s\n", addr.sun_path);
+			title[ws[2]] = '\0';
+		}
+		tabuse(i);
+		tload(s, fds[i]);
+		/* tload() may have restored queued input */
+		tabs[i] = (Tab){ .fd = fds[i], .out = 1, .title = title };
+		win.mode = (win.mode & ~TABMODE) | ws[0];
+		win.cursor = ws[1];
+	}
+	for (; i < LEN(tabs); i++)
+		tabs[i].fd = -1;
+	tabuse(hdr[1]);
+	tab = hdr[1];
+	cols = hdr[2];
+	rows = hdr[3];
+	attachfd = s;
+}
+
 void
 usage(void)
 {
-	die("usage: %s [-aiv] [-c class] [-f font] [-g geometry]"
+	die("usage: %s [-aiCdv] [-c class] [-f font] [-g geometry]"
 	    " [-n name] [-o file]\n"
-	    "          [-T title] [-t title] [-w windowid]"
+	    "          [-R file] [-T title] [-t title] [-w windowid]"
 	    " [[-e] command [args ...]]\n"
-	    "       %s [-aiv] [-c class] [-f font] [-g geometry]"
+	    "       %s [-aiCdv] [-c class] [-f font] [-g geometry]"
 	    " [-n name] [-o file]\n"
-	    "          [-T title] [-t title] [-w windowid] -l line"
-	    " [stty_args ...]\n", argv0, argv0);
+	    "          [-R file] [-T title] [-t title] [-w windowid] -l line"
+	    " [stty_args ...]\n"
+	    "       %s [-aiv] [-c class] [-f font] [-g geometry]"
+	    " [-n name] [-R file]\n"
+	    "          [-T title] [-t title] [-w windowid] [-F] -P file\n"
+	    "       %s [-aiv] [-c class] [-f font] [-g geometry]"
+	    " [-n name] [-T title]\n"
+	    "          [-t title] [-w windowid] -r [pid]\n"
+	    "       %s -D\n",
+	    argv0, argv0, argv0, argv0, argv0);
 }
 
 int
 main(int argc, char *argv[])
 {
+	int nargs, col, row, which = 0;
+	int served = argc == 2 && !strcmp(argv[1], "-D");
+	char **args;
+
+	if (served)
+		stdaemon(&argc, &argv);
+	nargs = argc;
+	args = argv;
+
 	xw.l = xw.t = 0;
 	xw.isfixed = False;
 	xsetcursor(cursorshape);
@@ -2113,6 +3469,14 @@ main(int argc, char *argv[])
 	case 'c':
 		opt_class = EARGF(usage());
 		break;
+	case 'd':
+		opt_detach = 1;
+		break;
+	case 'C':
+		/* in a window of the daemon, the client has done this */
+		if (!served)
+			stclient(nargs, args);
+		break;
 	case 'e':
 		if (argc > 0)
 			--argc, ++argv;
@@ -2120,6 +3484,9 @@ main(int argc, char *argv[])
 	case 'f':
 		opt_font = EARGF(usage());
 		break;
+	case 'F':
+		opt_fast = 1;
+		break;
 	case 'g':
 		xw.gm = XParseGeometry(EARGF(usage()),
 				&xw.l, &xw.t, &cols, &rows);
@@ -2136,6 +3503,15 @@ main(int argc, char *argv[])
 	case 'n':
 		opt_name = EARGF(usage());
 		break;
+	case 'P':
+		opt_replay = EARGF(usage());
+		break;
+	case 'r':
+		opt_attach = opt_detach = 1;
+		break;
+	case 'R':
+		opt_record = EARGF(usage());
+		break;
 	case 't':
 	case 'T':
 		opt_title = EARGF(usage());
@@ -2151,7 +3527,9 @@ main(int argc, char *argv[])
 	} ARGEND;
 
 run:
-	if (argc > 0) /* eat all remaining arguments */
+	if (opt_attach && argc > 0) /* the pid of the st to take over */
+		which = atoi(argv[0]);
+	else if (argc > 0) /* eat all remaining arguments */
 		opt_cmd = argv;
 
 	if (!opt_title)
@@ -2164,10 +3542,18 @@ run:
 		die("Can't open display\n");
 
 	config_init();
+	if (opt_replay) {
+		fclose(recordopen(opt_replay, &col, &row));
+		cols = col;
+		rows = row;
+		xw.isfixed = 1;
+	}
 	cols = MAX(cols, 1);
 	rows = MAX(rows, 1);
 	defaultbg = MAX(LEN(colorname), 256);
 	tnew(cols, rows);
+	if (opt_attach)
+		attach(which);
 	xinit(cols, rows);
 	xsetenv();
 	selinit();